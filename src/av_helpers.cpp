@@ -7,6 +7,7 @@ extern "C" {
 #include <libavformat/avio.h>
 #include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 }
 
 namespace oryx::av {
@@ -14,8 +15,21 @@ namespace oryx::av {
 namespace detail {
 
 void DictionaryDeleter::operator()(AVDictionary* ptr) const { av_dict_free(&ptr); }
-void PacketDeleter::operator()(AVPacket* ptr) const { av_packet_free(&ptr); }
-void FrameDeleter::operator()(AVFrame* ptr) const { av_frame_free(&ptr); }
+void PacketDeleter::operator()(AVPacket* ptr) const {
+    if (pool) {
+        pool->Release(ptr);
+    } else {
+        av_packet_free(&ptr);
+    }
+}
+
+void FrameDeleter::operator()(AVFrame* ptr) const {
+    if (pool) {
+        pool->Release(ptr);
+    } else {
+        av_frame_free(&ptr);
+    }
+}
 void SwsContextDeleter::operator()(SwsContext* ptr) const { sws_freeContext(ptr); }
 void CodecParserContextDeleter::operator()(AVCodecParserContext* ptr) const { av_parser_close(ptr); }
 void CodecContextDeleter::operator()(AVCodecContext* ptr) const { avcodec_free_context(&ptr); }
@@ -25,6 +39,86 @@ void IoContextDeleter::operator()(AVIOContext* ptr) const { avio_close(ptr); }
 
 }  // namespace detail
 
+namespace {
+
+template <typename T>
+auto Alloc() -> T*;
+
+template <>
+auto Alloc<AVPacket>() -> AVPacket* {
+    return av_packet_alloc();
+}
+
+template <>
+auto Alloc<AVFrame>() -> AVFrame* {
+    return av_frame_alloc();
+}
+
+void Unref(AVPacket* ptr) { av_packet_unref(ptr); }
+void Unref(AVFrame* ptr) { av_frame_unref(ptr); }
+void Free(AVPacket* ptr) { av_packet_free(&ptr); }
+void Free(AVFrame* ptr) { av_frame_free(&ptr); }
+
+}  // namespace
+
+template <typename T>
+auto ObjectPool<T>::Create(size_t max_cached) -> std::shared_ptr<ObjectPool> {
+    return std::shared_ptr<ObjectPool>(new ObjectPool(max_cached));
+}
+
+template <typename T>
+ObjectPool<T>::ObjectPool(size_t max_cached)
+    : mutex_(),
+      free_(),
+      max_cached_(max_cached),
+      allocations_() {
+    free_.reserve(max_cached_);
+}
+
+template <typename T>
+ObjectPool<T>::~ObjectPool() {
+    for (auto ptr : free_) {
+        Free(ptr);
+    }
+}
+
+template <typename T>
+auto ObjectPool<T>::Acquire() -> Handle {
+    T* ptr{};
+    {
+        std::lock_guard lock(mutex_);
+        if (!free_.empty()) {
+            ptr = free_.back();
+            free_.pop_back();
+        }
+    }
+
+    if (!ptr) {
+        ptr = Alloc<T>();
+        if (!ptr) {
+            return Handle();
+        }
+        allocations_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return Handle(ptr, {this->shared_from_this()});
+}
+
+template <typename T>
+void ObjectPool<T>::Release(T* ptr) {
+    Unref(ptr);
+    {
+        std::lock_guard lock(mutex_);
+        if (free_.size() < max_cached_) {
+            free_.push_back(ptr);
+            return;
+        }
+    }
+    Free(ptr);
+}
+
+template class ObjectPool<AVPacket>;
+template class ObjectPool<AVFrame>;
+
 ImageBuffer::ImageBuffer()
     : data(nullptr),
       linesizes(),
@@ -69,4 +163,61 @@ auto GetSwsConvertFormatContext(int from, int to, ImageSize size, int flags) ->
                                               nullptr));
 }
 
+auto UpdateSwsConvertFormatContext(UniqueSwsContextPtr& ctx, int from, int to, ImageSize size, int flags)
+    -> SwsContext* {
+    ctx.reset(sws_getCachedContext(ctx.release(), size.width, size.height, static_cast<AVPixelFormat>(from),
+                                   size.width, size.height, static_cast<AVPixelFormat>(to), flags, nullptr, nullptr,
+                                   nullptr));
+    return ctx.get();
+}
+
+auto UpdateSwsScaleContext(UniqueSwsContextPtr& ctx, ImageSize from_size, int from, ImageSize to_size, int to,
+                           int flags) -> SwsContext* {
+    ctx.reset(sws_getCachedContext(ctx.release(), from_size.width, from_size.height, static_cast<AVPixelFormat>(from),
+                                   to_size.width, to_size.height, static_cast<AVPixelFormat>(to), flags, nullptr,
+                                   nullptr, nullptr));
+    return ctx.get();
+}
+
+auto WrapImage(const Image& image, ImageSize size, int pix_fmt, AVFrame* frame) -> int {
+    auto format = static_cast<AVPixelFormat>(pix_fmt);
+    int buffer_size =
+        av_image_fill_arrays(frame->data, frame->linesize, image.data, format, size.width, size.height, 1);
+    if (buffer_size < 0) {
+        return buffer_size;
+    }
+
+    if (av_pix_fmt_count_planes(format) == 1) {
+        // Packed rows may be padded
+        frame->linesize[0] = static_cast<int>(image.step);
+    } else if (!image.isContinuous() || image.total() * image.elemSize() < static_cast<size_t>(buffer_size)) {
+        return AVERROR(EINVAL);
+    }
+
+    frame->buf[0] = av_buffer_create(image.data, buffer_size, [](void*, uint8_t*) {}, nullptr, AV_BUFFER_FLAG_READONLY);
+    if (!frame->buf[0]) {
+        return AVERROR(ENOMEM);
+    }
+    frame->format = pix_fmt;
+    frame->width = size.width;
+    frame->height = size.height;
+    return 0;
+}
+
+auto ToAVPixelFormat(PixelFormat format) -> int {
+    switch (format) {
+        case PixelFormat::kBgr24:
+            return AV_PIX_FMT_BGR24;
+        case PixelFormat::kGray8:
+            return AV_PIX_FMT_GRAY8;
+        case PixelFormat::kYuv420p:
+            return AV_PIX_FMT_YUV420P;
+        case PixelFormat::kNv12:
+            return AV_PIX_FMT_NV12;
+        case PixelFormat::kNative:
+            break;
+    }
+    return AV_PIX_FMT_NONE;
+}
+
 }  // namespace oryx::av
\ No newline at end of file
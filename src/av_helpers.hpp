@@ -1,6 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
 #include <memory>
+#include <vector>
 
 #include "image.hpp"
 
@@ -16,21 +19,29 @@ struct AVBitStreamFilter;
 struct AVCodec;
 struct AVFormatContext;
 struct AVIOContext;
+struct AVStream;
+struct AVCodecParameters;
 
 namespace oryx::av {
 
+template <typename T>
+class ObjectPool;
+
 namespace detail {
 
 struct DictionaryDeleter {
     void operator()(AVDictionary* ptr) const;
 };
 
+// Packets and frames acquired from an ObjectPool carry it and go back to it instead of being freed
 struct PacketDeleter {
     void operator()(AVPacket* ptr) const;
+    std::shared_ptr<ObjectPool<AVPacket>> pool;
 };
 
 struct FrameDeleter {
     void operator()(AVFrame* ptr) const;
+    std::shared_ptr<ObjectPool<AVFrame>> pool;
 };
 
 struct SwsContextDeleter {
@@ -69,6 +80,66 @@ using UniqueDictionaryPtr = std::unique_ptr<AVDictionary, detail::DictionaryDele
 using UniqueFormatContextPtr = std::unique_ptr<AVFormatContext, detail::FormatContextDeleter>;
 using UniqueIoContextPtr = std::unique_ptr<AVIOContext, detail::IoContextDeleter>;
 
+namespace detail {
+
+template <typename T>
+struct PoolTraits;
+
+template <>
+struct PoolTraits<AVPacket> {
+    using Handle = UniquePacketPtr;
+};
+
+template <>
+struct PoolTraits<AVFrame> {
+    using Handle = UniqueFramePtr;
+};
+
+}  // namespace detail
+
+/**
+ * @brief Recycles AVPackets or AVFrames. Released handles unref their data and return to the pool instead of being
+ * freed, so a steady stream of packets stops hitting the allocator. Handles may be released on any thread and keep
+ * the pool alive.
+ */
+template <typename T>
+class ObjectPool : public std::enable_shared_from_this<ObjectPool<T>> {
+public:
+    using Handle = typename detail::PoolTraits<T>::Handle;
+
+    static constexpr size_t kDefaultMaxCached = 64;
+
+    /**
+     * @param max_cached Released objects kept for reuse, objects beyond are freed
+     */
+    static auto Create(size_t max_cached = kDefaultMaxCached) -> std::shared_ptr<ObjectPool>;
+
+    ~ObjectPool();
+
+    auto Acquire() -> Handle;
+
+    /**
+     * @brief Objects allocated so far. Stays flat once the pool is warmed up
+     */
+    auto allocations() const -> uint64_t { return allocations_.load(std::memory_order_relaxed); }
+
+private:
+    friend struct detail::PacketDeleter;
+    friend struct detail::FrameDeleter;
+
+    explicit ObjectPool(size_t max_cached);
+
+    void Release(T* ptr);
+
+    std::mutex mutex_;
+    std::vector<T*> free_;
+    size_t max_cached_;
+    std::atomic<uint64_t> allocations_;
+};
+
+using PacketPool = ObjectPool<AVPacket>;
+using FramePool = ObjectPool<AVFrame>;
+
 // make this move only
 struct ImageBuffer {
     ImageBuffer();
@@ -88,4 +159,29 @@ auto MakeUniqueCodecContext(const AVCodec* codec) -> UniqueCodecContextPtr;
 auto MakeUniqueBsfContext(const AVBitStreamFilter* filter) -> UniqueBsfContextPtr;
 auto GetSwsConvertFormatContext(int from, int to, ImageSize size, int flags) -> UniqueSwsContextPtr;
 
+/**
+ * @brief Keeps ctx if it already converts with these parameters, otherwise replaces it
+ */
+auto UpdateSwsConvertFormatContext(UniqueSwsContextPtr& ctx, int from, int to, ImageSize size, int flags)
+    -> SwsContext*;
+
+/**
+ * @brief Same as UpdateSwsConvertFormatContext for contexts that also scale from from_size to to_size
+ */
+auto UpdateSwsScaleContext(UniqueSwsContextPtr& ctx, ImageSize from_size, int from, ImageSize to_size, int to,
+                           int flags) -> SwsContext*;
+
+/**
+ * @brief Points frame at image's memory without copying. Planar formats are expected as one continuous image with
+ * the planes following each other, like OpenCV's I420 layout. The frame is reference counted with a buffer that does
+ * not own the memory, image has to outlive every reference
+ * @return Negative AVERROR on failure
+ */
+auto WrapImage(const Image& image, ImageSize size, int pix_fmt, AVFrame* frame) -> int;
+
+/**
+ * @brief AVPixelFormat of format. AV_PIX_FMT_NONE for PixelFormat::kNative
+ */
+auto ToAVPixelFormat(PixelFormat format) -> int;
+
 }  // namespace oryx::av
\ No newline at end of file
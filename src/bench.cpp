@@ -0,0 +1,569 @@
+#include <new>
+#include <print>
+#include <format>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include <time.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/cpu.h>
+#include <libavutil/frame.h>
+}
+
+#include <oryx/argparse.hpp>
+
+#include "av_helpers.hpp"
+#include "blocking_queue.hpp"
+#include "cpu_features.hpp"
+#include "frame_timestamp.hpp"
+#include "h264_encoder.hpp"
+#include "rtmp_output.hpp"
+#include "rtmp_server.hpp"
+#include "rtmp_session.hpp"
+
+using std::println;
+using namespace oryx;
+using namespace std::chrono_literals;
+
+using Clock = std::chrono::steady_clock;
+
+// Heap allocations through operator new. libav's own buffers are not counted, they are pooled by the pipeline
+static std::atomic<uint64_t> heap_allocations;
+
+auto operator new(size_t size) -> void* {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+static auto HeapAllocations() -> uint64_t { return heap_allocations.load(std::memory_order_relaxed); }
+
+static auto ThreadCpuTime() -> std::chrono::nanoseconds {
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+static auto Percentile(std::vector<int64_t>& samples, double p) -> int64_t {
+    if (samples.empty()) return 0;
+    auto index = static_cast<size_t>(p * static_cast<double>(samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+enum class WaitMode { kSpin, kAdaptive };
+
+/**
+ * @brief Pushes a timestamp at frame_rate (0 = idle stream) and measures consumer cpu usage and wake up latency
+ */
+static void RunQueueBench(WaitMode mode, int frame_rate, std::chrono::milliseconds duration) {
+    BlockingQueue<Clock::time_point> queue(64);
+    std::vector<int64_t> latencies_us;
+    latencies_us.reserve(4096);
+    std::chrono::nanoseconds consumer_cpu{};
+
+    std::jthread consumer([&](std::stop_token stoken) {
+        const auto cpu_start = ThreadCpuTime();
+        Clock::time_point pushed_at;
+        while (!stoken.stop_requested()) {
+            bool popped{};
+            if (mode == WaitMode::kSpin) {
+                popped = queue.TryPop(pushed_at);
+            } else {
+                popped = queue.Pop(pushed_at, stoken);
+            }
+
+            if (popped) {
+                auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - pushed_at);
+                latencies_us.push_back(latency.count());
+            }
+        }
+        consumer_cpu = ThreadCpuTime() - cpu_start;
+    });
+
+    const auto start = Clock::now();
+    if (frame_rate > 0) {
+        const auto interval = std::chrono::nanoseconds(std::nano::den / frame_rate);
+        auto next = start;
+        while (Clock::now() - start < duration) {
+            next += interval;
+            std::this_thread::sleep_until(next);
+            queue.TryPush(Clock::now());
+        }
+    } else {
+        std::this_thread::sleep_for(duration);
+    }
+    consumer.request_stop();
+    consumer.join();
+
+    const auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    const auto cpu = std::chrono::duration<double>(consumer_cpu).count();
+    println("queue mode={} fps={} frames={} cpu={:.1f}% wake_p50={}us wake_p99={}us wake_max={}us",
+            mode == WaitMode::kSpin ? "spin" : "adaptive", frame_rate, latencies_us.size(), 100.0 * cpu / elapsed,
+            Percentile(latencies_us, 0.5), Percentile(latencies_us, 0.99), Percentile(latencies_us, 1.0));
+}
+
+enum class PacketSource { kAlloc, kPool };
+
+/**
+ * @brief Hands packets from a reader to a decoder thread like RtmpSession does and counts packets moved and packet
+ * allocations per second, with a fresh av_packet_alloc per packet or recycled from a PacketPool
+ */
+static void RunPacketAllocBench(PacketSource source, std::chrono::milliseconds duration) {
+    BlockingQueue<av::UniquePacketPtr> queue(64);
+    auto pool = av::PacketPool::Create();
+
+    std::jthread consumer([&](std::stop_token stoken) {
+        av::UniquePacketPtr packet;
+        while (queue.Pop(packet, stoken)) {
+            packet.reset();
+        }
+    });
+
+    uint64_t packets{};
+    const auto start = Clock::now();
+    while (Clock::now() - start < duration) {
+        auto packet = source == PacketSource::kPool ? pool->Acquire() : av::MakeUniquePacket();
+        queue.Push(std::move(packet), {});
+        packets++;
+    }
+    consumer.request_stop();
+    consumer.join();
+
+    const auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    const auto allocations = source == PacketSource::kPool ? pool->allocations() : packets;
+    println("packets source={} packets/s={:.0f} allocations/s={:.0f} allocations={}",
+            source == PacketSource::kPool ? "pool" : "alloc", packets / elapsed, allocations / elapsed, allocations);
+}
+
+static auto ToMicros(std::chrono::nanoseconds duration) -> int64_t {
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+static void PrintCpuFeatures() {
+    auto join = [](const std::vector<std::string>& names) {
+        std::string joined;
+        for (const auto& name : names) {
+            joined += std::format("{}\"{}\"", joined.empty() ? "" : ",", name);
+        }
+        return joined;
+    };
+    const auto features = DetectCpuFeatures();
+    println(R"({{"bench":"cpu","ffmpeg":[{}],"x264":[{}]}})", join(features.ffmpeg), join(features.x264));
+}
+
+static auto ParseSize(const std::string& value) -> ImageSize {
+    auto x = value.find('x');
+    return ImageSize(std::stoi(value.substr(0, x)), std::stoi(value.substr(x + 1)));
+}
+
+static auto SplitList(const std::string& value) -> std::vector<std::string> {
+    std::vector<std::string> items;
+    size_t begin = 0;
+    while (begin < value.size()) {
+        auto end = std::min(value.find(',', begin), value.size());
+        items.push_back(value.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return items;
+}
+
+/**
+ * @brief Fills a yuv420p frame with a gradient that moves with index, so the encoder has motion to work on
+ */
+static void FillSyntheticFrame(AVFrame* frame, int index) {
+    for (int plane = 0; plane < 3; plane++) {
+        const int width = plane == 0 ? frame->width : (frame->width + 1) / 2;
+        const int height = plane == 0 ? frame->height : (frame->height + 1) / 2;
+        for (int y = 0; y < height; y++) {
+            std::memset(frame->data[plane] + y * frame->linesize[plane], (y + index * 4 + plane * 64) & 0xff, width);
+        }
+    }
+}
+
+struct CodecBenchSettings {
+    int frames;
+    int frame_rate;
+    PixelFormat output_format;
+    size_t convert_threads;
+    int decoder_threads;
+    ImageSize output_size;  // 0 keeps the stream's
+    bool skip_loop_filter;
+};
+
+/**
+ * @brief Encodes settings.frames synthetic frames of size with H264Encoder into an flv file at path. One json line
+ * with the encoder's fps, per frame encode time and allocations
+ */
+static auto RunEncodeBench(ImageSize size, const CodecBenchSettings& settings, const std::string& path) -> bool {
+    H264Encoder encoder;
+    H264Encoder::Settings encoder_settings;
+    encoder_settings.size = size;
+    encoder_settings.frame_rate = settings.frame_rate;
+    encoder_settings.bitrate = size.width * size.height * settings.frame_rate / 10;
+    encoder_settings.input_format = PixelFormat::kYuv420p;
+
+    auto result = encoder.Open(encoder_settings);
+    RtmpOutput output;
+    if (result) {
+        result = output.Open(path, encoder.codec_ctx());
+    }
+    if (!result) {
+        println(stderr, "Failed to open encoder for {}x{}: {}", size.width, size.height, result.error().what());
+        return false;
+    }
+
+    auto frame = av::MakeUniqueFrame();
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = size.width;
+    frame->height = size.height;
+    if (av_frame_get_buffer(frame.get(), 0) < 0) {
+        return false;
+    }
+
+    auto on_packet = [&output](av::UniquePacketPtr packet) { (void)output.Write(packet.get()); };
+    const auto allocations_start = HeapAllocations();
+    const auto start = Clock::now();
+    for (int i = 0; i < settings.frames && result; i++) {
+        FillSyntheticFrame(frame.get(), i);
+        result = encoder.Encode(frame.get(), on_packet);
+    }
+    const auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    const auto allocations = HeapAllocations() - allocations_start;
+    output.Close();
+    if (!result) {
+        println(stderr, "Failed to encode {}x{}: {}", size.width, size.height, result.error().what());
+        return false;
+    }
+
+    const auto stats = encoder.stats();
+    println(R"({{"bench":"encode","width":{},"height":{},"frames":{},"fps":{:.1f},"encode_p50_us":{},)"
+            R"("encode_p99_us":{},"encode_max_us":{},"bytes":{},"allocations_per_frame":{:.2f}}})",
+            size.width, size.height, stats.frames, stats.frames / elapsed, ToMicros(stats.encode_time.Percentile(0.5)),
+            ToMicros(stats.encode_time.Percentile(0.99)), ToMicros(std::chrono::nanoseconds(stats.encode_time.max_ns)),
+            stats.bytes, static_cast<double>(allocations) / std::max<uint64_t>(stats.frames, 1));
+    return true;
+}
+
+/**
+ * @brief Runs the file at path through RtmpSession's read, decode and convert path as fast as it goes. One json line
+ * with fps, per frame decode, convert and read to handler latency and allocations
+ */
+static void RunDecodeBench(const std::string& path, const CodecBenchSettings& settings) {
+    RtmpServer::Settings server_settings;
+    server_settings.url = path;
+    server_settings.queue_size = 32;
+    // A file reads faster than it decodes, block instead of dropping
+    server_settings.overflow_policy = RtmpServer::OverflowPolicy::kBlock;
+    server_settings.output_format = settings.output_format;
+    server_settings.decoder_threads = settings.decoder_threads;
+    server_settings.convert_threads = settings.convert_threads;
+    server_settings.output_size = settings.output_size;
+    server_settings.skip_loop_filter = settings.skip_loop_filter;
+
+    ImageSize size;
+    RtmpServer::Handlers handlers;
+    handlers.on_frame = [](VideoFrame) {};
+    handlers.on_connect = [&size](RtmpServer::StreamInfo info) { size = info.resolution; };
+    handlers.on_error = [](Error error) { println(stderr, "Decode error: {}", error.what()); };
+
+    AVFormatContext* fmt_ctx{};
+    int ret = avformat_open_input(&fmt_ctx, path.c_str(), nullptr, nullptr);
+    if (ret < 0) {
+        println(stderr, "Failed to open {}: {}", path, av::MakeError(ret).what());
+        return;
+    }
+
+    RtmpSession::Connection connection;
+    connection.fmt_ctx = av::UniqueFormatContextPtr(fmt_ctx);
+    connection.stream_key = path;
+    connection.connected_at = Clock::now();
+
+    RtmpSession session(server_settings, handlers, nullptr);
+    const auto allocations_start = HeapAllocations();
+    const auto start = Clock::now();
+    session.Run(std::move(connection), {});
+    const auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    const auto allocations = HeapAllocations() - allocations_start;
+
+    const auto stats = session.stats();
+    const bool simd = !DetectCpuFeatures().ffmpeg.empty();
+    const auto output_size = settings.output_size.width > 0 ? settings.output_size : size;
+    println(R"({{"bench":"decode","asm":{},"width":{},"height":{},"output_width":{},"output_height":{},)"
+            R"("skip_loop_filter":{},"frames":{},"fps":{:.1f},"decode_p50_us":{},"decode_p99_us":{},)"
+            R"("convert_p50_us":{},"convert_p99_us":{},"latency_p50_us":{},"latency_p99_us":{},)"
+            R"("first_image_us":{},"allocations_per_frame":{:.2f}}})",
+            simd, size.width, size.height, output_size.width, output_size.height, settings.skip_loop_filter,
+            stats.decoded_frames, stats.decoded_frames / elapsed,
+            ToMicros(stats.decode_time.Percentile(0.5)), ToMicros(stats.decode_time.Percentile(0.99)),
+            ToMicros(stats.convert_time.Percentile(0.5)), ToMicros(stats.convert_time.Percentile(0.99)),
+            ToMicros(stats.latency.Percentile(0.5)), ToMicros(stats.latency.Percentile(0.99)),
+            ToMicros(std::chrono::nanoseconds(stats.first_image.max_ns)),
+            static_cast<double>(allocations) / std::max<uint64_t>(stats.decoded_frames, 1));
+}
+
+struct LoopbackCase {
+    std::chrono::milliseconds buffer_time;
+    size_t queue_size;
+    const char* profile_name;
+    H264Encoder::Profile profile;
+};
+
+/**
+ * @brief Publishes stamped synthetic frames at frame_rate to an RtmpServer in the same process over 127.0.0.1 and
+ * measures capture to frame handler latency from the time burnt into every frame. One json line per case
+ */
+static void RunLoopbackBench(const LoopbackCase& test, ImageSize size, int frame_rate,
+                             std::chrono::milliseconds duration) {
+    static constexpr char kUrl[] = "rtmp://127.0.0.1:19350/bench";
+
+    RtmpServer::Settings server_settings;
+    server_settings.url = kUrl;
+    server_settings.buffer_time = test.buffer_time;
+    server_settings.queue_size = test.queue_size;
+
+    SampleRecorder latency;
+    std::atomic<uint64_t> received{};
+    RtmpServer server(server_settings);
+    server.SetFrameHandler([&](VideoFrame frame) {
+        if (auto captured = ReadFrameTime(frame.image())) {
+            latency.Record(std::chrono::system_clock::now() - *captured);
+            received.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+    server.SetErrorHandler([](Error error) { println(stderr, "Server error: {}", error.what()); });
+    server.Start();
+
+    H264Encoder encoder;
+    H264Encoder::Settings encoder_settings;
+    encoder_settings.size = size;
+    encoder_settings.frame_rate = frame_rate;
+    encoder_settings.bitrate = size.width * size.height * frame_rate / 10;
+    encoder_settings.input_format = PixelFormat::kYuv420p;
+    encoder_settings.profile = test.profile;
+    auto result = encoder.Open(encoder_settings);
+    if (!result) {
+        println(stderr, "Failed to open encoder: {}", result.error().what());
+        return;
+    }
+
+    // The server listens asynchronously, retry until it accepts
+    RtmpOutput output;
+    for (int attempt = 0; attempt < 50; attempt++) {
+        result = output.Open(kUrl, encoder.codec_ctx());
+        if (result) {
+            break;
+        }
+        std::this_thread::sleep_for(20ms);
+    }
+    if (!result) {
+        println(stderr, "Failed to connect to {}: {}", kUrl, result.error().what());
+        return;
+    }
+
+    auto frame = av::MakeUniqueFrame();
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = size.width;
+    frame->height = size.height;
+    if (av_frame_get_buffer(frame.get(), 0) < 0) {
+        return;
+    }
+    Image luma(size.height, size.width, CV_8UC1, frame->data[0], frame->linesize[0]);
+
+    auto on_packet = [&output](av::UniquePacketPtr packet) { (void)output.Write(packet.get()); };
+    const auto interval = std::chrono::nanoseconds(std::nano::den / frame_rate);
+    const auto start = Clock::now();
+    auto next = start;
+    uint64_t sent{};
+    while (Clock::now() - start < duration && result) {
+        std::this_thread::sleep_until(next);
+        next += interval;
+        FillSyntheticFrame(frame.get(), static_cast<int>(sent));
+        StampFrameTime(luma, std::chrono::system_clock::now());
+        result = encoder.Encode(frame.get(), on_packet);
+        sent++;
+    }
+    output.Close();
+    server.Stop();
+
+    // Frames whose stamp didn't survive are missing from the percentiles, a few in flight at the end are expected
+    if (received.load() + frame_rate < sent) {
+        println(stderr, "Only {} of {} sent frames carried a readable stamp, latency is not representative",
+                received.load(), sent);
+    }
+
+    const auto samples = latency.Take();
+    println(R"({{"bench":"loopback","width":{},"height":{},"fps":{},"buffer_time_ms":{},"queue_size":{},)"
+            R"("profile":"{}","sent":{},"received":{},"latency_p50_us":{},"latency_p90_us":{},"latency_p99_us":{},)"
+            R"("latency_max_us":{}}})",
+            size.width, size.height, frame_rate, test.buffer_time.count(), test.queue_size, test.profile_name, sent,
+            received.load(), ToMicros(Percentile(samples, 0.5)), ToMicros(Percentile(samples, 0.9)),
+            ToMicros(Percentile(samples, 0.99)), ToMicros(Percentile(samples, 1.0)));
+}
+
+auto main(int argc, char* argv[]) -> int {
+    if (argc < 2) {
+        println("Example Usage:\n {0} --queue --packets --duration 5000\n {0} --codec --sizes 1280x720,1920x1080\n"
+                " {0} --loopback --buffer-times 100,1000 --queue-sizes 2,64", argv[0]);
+        return 1;
+    }
+
+    auto cli = argparse::CLI(argc, argv);
+    std::chrono::milliseconds duration{3000};
+
+    std::vector<ImageSize> sizes;
+
+    cli.VisitIfContains<std::string>("--duration", [&duration](std::string value) {
+        duration = std::chrono::milliseconds(std::stoi(value));
+    });
+
+    cli.VisitIfContains<std::string>("--sizes", [&sizes](std::string value) {
+        for (const auto& size : SplitList(value)) {
+            sizes.push_back(ParseSize(size));
+        }
+    });
+
+    if (cli.Contains("--queue")) {
+        for (auto mode : {WaitMode::kSpin, WaitMode::kAdaptive}) {
+            for (int frame_rate : {0, 60}) {
+                RunQueueBench(mode, frame_rate, duration);
+            }
+        }
+    }
+
+    if (cli.Contains("--packets")) {
+        for (auto source : {PacketSource::kAlloc, PacketSource::kPool}) {
+            RunPacketAllocBench(source, duration);
+        }
+    }
+
+    if (cli.Contains("--codec") || cli.Contains("--asm") || cli.Contains("--scale")) {
+        PrintCpuFeatures();
+        CodecBenchSettings settings{
+            .frames = 300,
+            .frame_rate = 30,
+            .output_format = PixelFormat::kBgr24,
+            .convert_threads = 1,
+            .decoder_threads = 1,
+            .output_size = {},
+            .skip_loop_filter = false,
+        };
+        if (sizes.empty()) {
+            sizes = {{640, 360}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+        }
+
+        cli.VisitIfContains<std::string>("--frames", [&](std::string value) { settings.frames = std::stoi(value); });
+        cli.VisitIfContains<std::string>("--convert-threads", [&](std::string value) {
+            settings.convert_threads = std::stoul(value);
+        });
+        cli.VisitIfContains<std::string>("--decoder-threads", [&](std::string value) {
+            settings.decoder_threads = std::stoi(value);
+        });
+        if (cli.Contains("--yuv")) {
+            settings.output_format = PixelFormat::kYuv420p;
+        }
+        ImageSize scaled_size(640, 360);
+        cli.VisitIfContains<std::string>("--output-size", [&](std::string value) {
+            scaled_size = ParseSize(value);
+            settings.output_size = scaled_size;
+        });
+        if (cli.Contains("--skip-loop-filter")) {
+            settings.skip_loop_filter = true;
+        }
+
+        // Every size is encoded once, then decoded and converted with FFmpeg's SIMD and again with plain C
+        if (cli.Contains("--asm")) {
+            for (auto size : sizes) {
+                const auto path = std::format("/tmp/rtmp_bench_{}x{}.flv", size.width, size.height);
+                if (RunEncodeBench(size, settings, path)) {
+                    for (int cpu_flags : {-1, 0}) {
+                        av_force_cpu_flags(cpu_flags);
+                        RunDecodeBench(path, settings);
+                    }
+                    av_force_cpu_flags(-1);
+                }
+                std::remove(path.c_str());
+            }
+        } else if (cli.Contains("--scale")) {
+            // Every size is encoded once, then delivered at its own size, scaled down in the conversion pass and
+            // scaled down without the loop filter
+            for (auto size : sizes) {
+                const auto path = std::format("/tmp/rtmp_bench_{}x{}.flv", size.width, size.height);
+                const std::pair<ImageSize, bool> variants[] = {{{}, false}, {scaled_size, false}, {scaled_size, true}};
+                if (RunEncodeBench(size, settings, path)) {
+                    for (auto [output_size, skip_loop_filter] : variants) {
+                        auto scale_settings = settings;
+                        scale_settings.output_size = output_size;
+                        scale_settings.skip_loop_filter = skip_loop_filter;
+                        RunDecodeBench(path, scale_settings);
+                    }
+                }
+                std::remove(path.c_str());
+            }
+        } else if (cli.Contains("--input")) {
+            // A pre encoded file is only decoded
+            cli.VisitIfContains<std::string>("--input", [&settings](std::string path) {
+                RunDecodeBench(path, settings);
+            });
+        } else {
+            // Every size is encoded first and the result decoded
+            for (auto size : sizes) {
+                const auto path = std::format("/tmp/rtmp_bench_{}x{}.flv", size.width, size.height);
+                if (RunEncodeBench(size, settings, path)) {
+                    RunDecodeBench(path, settings);
+                }
+                std::remove(path.c_str());
+            }
+        }
+    }
+
+    if (cli.Contains("--loopback")) {
+        std::vector<std::chrono::milliseconds> buffer_times{100ms, 500ms, 1000ms};
+        std::vector<size_t> queue_sizes{2, 8, 64};
+        int frame_rate{30};
+
+        cli.VisitIfContains<std::string>("--buffer-times", [&buffer_times](std::string value) {
+            buffer_times.clear();
+            for (const auto& item : SplitList(value)) {
+                buffer_times.emplace_back(std::stoll(item));
+            }
+        });
+        cli.VisitIfContains<std::string>("--queue-sizes", [&queue_sizes](std::string value) {
+            queue_sizes.clear();
+            for (const auto& item : SplitList(value)) {
+                queue_sizes.push_back(std::max<size_t>(std::stoul(item), 1));
+            }
+        });
+        cli.VisitIfContains<std::string>("--fps", [&frame_rate](std::string value) {
+            frame_rate = std::max(std::stoi(value), 1);
+        });
+
+        const std::pair<const char*, H264Encoder::Profile> profiles[] = {
+            {"default", H264Encoder::Profile{}},
+            {"low-latency", H264Encoder::Profile::LowLatency()},
+            {"high-throughput", H264Encoder::Profile::HighThroughput()},
+        };
+        const auto size = sizes.empty() ? ImageSize(1280, 720) : sizes.front();
+        for (auto buffer_time : buffer_times) {
+            for (auto queue_size : queue_sizes) {
+                for (const auto& [name, profile] : profiles) {
+                    RunLoopbackBench({buffer_time, queue_size, name, profile}, size, frame_rate, duration);
+                }
+            }
+        }
+    }
+    return 0;
+}
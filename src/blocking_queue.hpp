@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <stop_token>
+#include <thread>
+
+#include <oryx/spsc_queue.hpp>
+
+namespace oryx {
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+/**
+ * @brief Single producer single consumer queue with an adaptive wait on both ends. Blocking calls spin for a short
+ * while and then park on an atomic sequence counter until the other side makes progress or a stop is requested, so
+ * an idle consumer (or a producer stuck on a full queue) costs no cpu.
+ */
+template <typename T>
+class BlockingQueue {
+public:
+    static constexpr int kSpinCount = 256;
+
+    explicit BlockingQueue(size_t size)
+        : queue_(size + 1),
+          pushed_(),
+          popped_(),
+          pop_waiters_(),
+          push_waiters_() {}
+
+    auto TryPush(T&& item) -> bool {
+        if (!queue_.write(std::move(item))) {
+            return false;
+        }
+        Notify(pushed_, pop_waiters_);
+        return true;
+    }
+
+    auto TryPop(T& item) -> bool {
+        if (!queue_.read(item)) {
+            return false;
+        }
+        Notify(popped_, push_waiters_);
+        return true;
+    }
+
+    /**
+     * @brief Blocks until there is space for item. Returns false if stop was requested on stoken
+     */
+    auto Push(T&& item, std::stop_token stoken) -> bool {
+        return Await(popped_, push_waiters_, stoken, [&] { return TryPush(std::move(item)); });
+    }
+
+    /**
+     * @brief Blocks until an item is available. Returns false if stop was requested on stoken
+     */
+    auto Pop(T& item, std::stop_token stoken) -> bool {
+        return Await(pushed_, pop_waiters_, stoken, [&] { return TryPop(item); });
+    }
+
+    /**
+     * @brief Drops all queued items. Must only be called while no consumer is running
+     */
+    void Clear() {
+        while (!queue_.isEmpty()) queue_.popFront();
+    }
+
+    auto Size() const -> size_t { return queue_.sizeGuess(); }
+    auto Capacity() const -> size_t { return queue_.capacity(); }
+
+private:
+    static void Notify(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiters) {
+        seq.fetch_add(1);
+        if (waiters.load() > 0) {
+            seq.notify_one();
+        }
+    }
+
+    template <typename Fn>
+    static auto Await(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiters, std::stop_token& stoken, Fn try_once)
+        -> bool {
+        for (int i = 0; i < kSpinCount; i++) {
+            if (try_once()) {
+                return true;
+            }
+            if (stoken.stop_requested()) {
+                return false;
+            }
+            CpuRelax();
+        }
+
+        std::stop_callback wake_on_stop(stoken, [&seq] {
+            seq.fetch_add(1);
+            seq.notify_all();
+        });
+
+        while (!stoken.stop_requested()) {
+            // Register as waiter before sampling the sequence so the other side either sees us or bumps the
+            // sequence we are about to wait on
+            waiters.fetch_add(1);
+            const auto value = seq.load();
+            if (try_once()) {
+                waiters.fetch_sub(1);
+                return true;
+            }
+            seq.wait(value);
+            waiters.fetch_sub(1);
+        }
+        return false;
+    }
+
+    folly::ProducerConsumerQueue<T> queue_;
+    std::atomic<uint32_t> pushed_;
+    std::atomic<uint32_t> popped_;
+    std::atomic<uint32_t> pop_waiters_;
+    std::atomic<uint32_t> push_waiters_;
+};
+
+}  // namespace oryx
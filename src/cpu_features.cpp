@@ -0,0 +1,72 @@
+#include "cpu_features.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/cpu.h>
+#include <x264.h>
+}
+
+namespace oryx {
+
+namespace {
+
+struct CpuFlagName {
+    int flag;
+    const char* name;
+};
+
+constexpr CpuFlagName kFfmpegCpuFlags[] = {
+    {AV_CPU_FLAG_SSE2, "sse2"},   {AV_CPU_FLAG_SSE3, "sse3"},   {AV_CPU_FLAG_SSSE3, "ssse3"},
+    {AV_CPU_FLAG_SSE4, "sse4.1"}, {AV_CPU_FLAG_SSE42, "sse4.2"}, {AV_CPU_FLAG_AVX, "avx"},
+    {AV_CPU_FLAG_AVX2, "avx2"},   {AV_CPU_FLAG_FMA3, "fma3"},   {AV_CPU_FLAG_AVX512, "avx512"},
+    {AV_CPU_FLAG_ARMV8, "armv8"}, {AV_CPU_FLAG_NEON, "neon"},   {AV_CPU_FLAG_DOTPROD, "dotprod"},
+    {AV_CPU_FLAG_I8MM, "i8mm"},
+};
+
+// Whether FFmpeg detects the cpu when built with --disable-asm depends on the platform, its configuration tells
+// whether anything could use it
+auto FfmpegHasAsm() -> bool { return std::strstr(avutil_configuration(), "--disable-asm") == nullptr; }
+
+}  // namespace
+
+auto DetectCpuFeatures() -> CpuFeatures {
+    CpuFeatures features;
+
+    const int ffmpeg_flags = FfmpegHasAsm() ? av_get_cpu_flags() : 0;
+    for (const auto& [flag, name] : kFfmpegCpuFlags) {
+        if (ffmpeg_flags & flag) {
+            features.ffmpeg.emplace_back(name);
+        }
+    }
+
+    // x264 detects the cpu when filling in default parameters, without assembly it detects nothing. Names of
+    // combined flags are listed like x264 logs them when opening an encoder
+    x264_param_t param;
+    x264_param_default(&param);
+    for (int i = 0; x264_cpu_names[i].flags; i++) {
+        const auto flags = x264_cpu_names[i].flags;
+        if ((param.cpu & flags) == flags && (i == 0 || flags != x264_cpu_names[i - 1].flags)) {
+            features.x264.emplace_back(x264_cpu_names[i].name);
+        }
+    }
+    return features;
+}
+
+auto ToString(const CpuFeatures& features) -> std::string {
+    auto join = [](const std::vector<std::string>& names) -> std::string {
+        if (names.empty()) {
+            return "none";
+        }
+        std::string joined;
+        for (const auto& name : names) {
+            joined += joined.empty() ? name : "," + name;
+        }
+        return joined;
+    };
+    return "ffmpeg=" + join(features.ffmpeg) + " x264=" + join(features.x264);
+}
+
+}  // namespace oryx
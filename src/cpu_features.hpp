@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace oryx {
+
+/**
+ * @brief SIMD paths FFmpeg and x264 use on this machine. Either is empty when its library was built without
+ * assembly, or FFmpeg's were turned off with av_force_cpu_flags
+ */
+struct CpuFeatures {
+    std::vector<std::string> ffmpeg;
+    std::vector<std::string> x264;
+};
+
+auto DetectCpuFeatures() -> CpuFeatures;
+
+/**
+ * @brief One line summary for logs, e.g. "ffmpeg=sse2,avx2 x264=SSE2,AVX2"
+ */
+auto ToString(const CpuFeatures& features) -> std::string;
+
+}  // namespace oryx
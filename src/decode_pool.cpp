@@ -0,0 +1,231 @@
+#include "decode_pool.hpp"
+
+#include <string>
+#include <format>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace oryx {
+
+namespace {
+
+// Worker the current thread belongs to, strands it schedules go to its own queue
+thread_local const DecodePool* current_pool{};
+thread_local size_t current_index{};
+
+// Cpus of a numa node from sysfs, e.g. "0-7,16-23". Empty if the node does not exist
+auto NumaNodeCpus(int node) -> std::vector<int> {
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    std::getline(file, list);
+
+    std::vector<int> cpus;
+    size_t begin = 0;
+    while (begin < list.size()) {
+        auto end = std::min(list.find(',', begin), list.size());
+        auto range = list.substr(begin, end - begin);
+        auto dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+        begin = end + 1;
+    }
+    return cpus;
+}
+
+// Cpus outside of the process' cpuset or beyond CPU_SETSIZE are rejected
+auto SetAffinity(std::jthread& thread, const std::vector<int>& cpus) -> std::optional<Error> {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            return Error(std::format("Cpu {} is out of range", cpu));
+        }
+        CPU_SET(cpu, &set);
+    }
+    int ret = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+    if (ret != 0) {
+        return Error(std::format("Failed to set decode thread affinity: {}", std::strerror(ret)));
+    }
+    return std::nullopt;
+}
+
+}  // namespace
+
+DecodePool::Strand::Strand(DecodePool& pool, std::function<void()> drain, std::function<bool()> has_work)
+    : pool_(pool),
+      drain_(std::move(drain)),
+      has_work_(std::move(has_work)),
+      scheduled_(),
+      closed_() {}
+
+DecodePool::Strand::~Strand() { Close(); }
+
+void DecodePool::Strand::Notify() {
+    if (closed_.load()) {
+        return;
+    }
+    if (!scheduled_.exchange(true)) {
+        Submit();
+    }
+}
+
+void DecodePool::Strand::Submit() {
+    // Checked under the lock Close waits with, so either Close sees scheduled_ and waits for the strand to run or we
+    // see closed_ and back off. Checked without it, Close could return just before the strand gets queued again
+    {
+        std::lock_guard lock(pool_.idle_mutex_);
+        if (closed_.load()) {
+            scheduled_.store(false);
+            pool_.idle_cv_.notify_all();
+            return;
+        }
+    }
+    pool_.Schedule(this);
+}
+
+void DecodePool::Strand::Open() { closed_.store(false); }
+
+void DecodePool::Strand::Close() {
+    closed_.store(true);
+
+    // Queued but not running yet, just take it out again
+    if (pool_.Remove(this)) {
+        scheduled_.store(false);
+    }
+
+    std::unique_lock lock(pool_.idle_mutex_);
+    pool_.idle_cv_.wait(lock, [this] { return !scheduled_.load(); });
+}
+
+DecodePool::DecodePool(Settings settings)
+    : queues_(),
+      queued_(),
+      next_queue_(),
+      idle_mutex_(),
+      work_cv_(),
+      idle_cv_(),
+      affinity_error_(),
+      workers_() {
+    auto node_cpus = settings.cpus.empty() && settings.numa_node >= 0 ? NumaNodeCpus(settings.numa_node)
+                                                                      : std::vector<int>();
+    if (settings.cpus.empty() && settings.numa_node >= 0 && node_cpus.empty()) {
+        affinity_error_ = Error(std::format("Numa node {} has no cpus", settings.numa_node));
+    }
+
+    size_t thread_count = settings.thread_count;
+    if (thread_count == 0) {
+        if (!settings.cpus.empty()) {
+            thread_count = settings.cpus.size();
+        } else if (!node_cpus.empty()) {
+            thread_count = node_cpus.size();
+        } else {
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+        }
+    }
+
+    // Queues have to exist before the first worker may steal from them
+    for (size_t i = 0; i < thread_count; i++) {
+        queues_.push_back(std::make_unique<RunQueue>());
+    }
+
+    workers_.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; i++) {
+        workers_.emplace_back([this, i](std::stop_token stoken) { Worker(i, stoken); });
+        std::optional<Error> error;
+        if (!settings.cpus.empty()) {
+            error = SetAffinity(workers_.back(), {settings.cpus[i % settings.cpus.size()]});
+        } else if (!node_cpus.empty()) {
+            error = SetAffinity(workers_.back(), node_cpus);
+        }
+        if (error && !affinity_error_) {
+            affinity_error_ = std::move(error);
+        }
+    }
+}
+
+DecodePool::DecodePool(size_t thread_count)
+    : DecodePool(Settings{.thread_count = thread_count, .cpus = {}, .numa_node = -1}) {}
+
+DecodePool::~DecodePool() { workers_.clear(); }
+
+void DecodePool::Schedule(Strand* strand) {
+    // Requeued from a worker it stays local and warm in that worker's cache, unless someone idle steals it
+    const size_t index =
+        current_pool == this ? current_index : next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+    {
+        std::lock_guard lock(queues_[index]->mutex);
+        queues_[index]->strands.push_back(strand);
+    }
+    queued_.fetch_add(1);
+
+    // Taking the lock orders this with a worker that checked queued_ and is about to wait
+    { std::lock_guard lock(idle_mutex_); }
+    work_cv_.notify_one();
+}
+
+auto DecodePool::Pop(size_t index) -> Strand* {
+    // Own queue first, then steal from the others. Always the strand waiting longest, so a stream readied late can't
+    // overtake one that has been queued behind a busy worker
+    for (size_t i = 0; i < queues_.size(); i++) {
+        auto& queue = *queues_[(index + i) % queues_.size()];
+        std::lock_guard lock(queue.mutex);
+        if (queue.strands.empty()) {
+            continue;
+        }
+
+        auto strand = queue.strands.front();
+        queue.strands.pop_front();
+        queued_.fetch_sub(1);
+        return strand;
+    }
+    return nullptr;
+}
+
+auto DecodePool::Remove(Strand* strand) -> bool {
+    for (auto& queue : queues_) {
+        std::lock_guard lock(queue->mutex);
+        auto it = std::ranges::find(queue->strands, strand);
+        if (it != queue->strands.end()) {
+            queue->strands.erase(it);
+            queued_.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void DecodePool::Worker(size_t index, std::stop_token stoken) {
+    current_pool = this;
+    current_index = index;
+
+    while (!stoken.stop_requested()) {
+        auto strand = Pop(index);
+        if (!strand) {
+            std::unique_lock lock(idle_mutex_);
+            work_cv_.wait(lock, stoken, [this] { return queued_.load() > 0; });
+            continue;
+        }
+
+        strand->drain_();
+
+        // Clear the flag before checking for work so a concurrent Notify either sees the cleared flag and schedules
+        // itself or we see its work here
+        strand->scheduled_.store(false);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!strand->closed_.load() && strand->has_work_() && !strand->scheduled_.exchange(true)) {
+            strand->Submit();
+        } else {
+            std::lock_guard lock(idle_mutex_);
+            idle_cv_.notify_all();
+        }
+    }
+}
+
+}  // namespace oryx
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include <oryx/expected.hpp>
+
+namespace oryx {
+
+/**
+ * @brief Fixed pool of decode threads shared by many sessions. Every worker has its own run queue, idle workers
+ * steal strands from the others so a few busy streams don't wait behind a worker stuck on a large frame.
+ */
+class DecodePool {
+public:
+    /**
+     * @brief Serial unit of work on the pool. Notifying a strand that is already queued or running is a no-op, so a
+     * strand never runs on two workers at once and per stream ordering is kept
+     */
+    class Strand {
+    public:
+        /**
+         * @param drain Runs a bounded batch of work on a pool thread
+         * @param has_work Tells the pool whether the strand has to be requeued after drain returned
+         */
+        Strand(DecodePool& pool, std::function<void()> drain, std::function<bool()> has_work);
+        ~Strand();
+
+        void Notify();
+        void Open();
+
+        /**
+         * @brief Stops scheduling and blocks until the strand is neither queued nor running
+         */
+        void Close();
+
+    private:
+        friend class DecodePool;
+
+        // Queues the strand after winning scheduled_, unless it got closed meanwhile
+        void Submit();
+
+        DecodePool& pool_;
+        std::function<void()> drain_;
+        std::function<bool()> has_work_;
+        std::atomic_bool scheduled_;
+        std::atomic_bool closed_;
+    };
+
+    struct Settings {
+        size_t thread_count;  // 0 uses one per cpu the workers may run on
+        std::vector<int> cpus;  // Worker i is pinned to cpus[i % cpus.size()]. Empty leaves placement to the OS
+        int numa_node{-1};      // Keeps every worker on the cpus of this node. Ignored when cpus is set
+    };
+
+    explicit DecodePool(Settings settings);
+
+    // thread_count 0 uses the number of hardware threads
+    explicit DecodePool(size_t thread_count);
+    ~DecodePool();
+
+    auto thread_count() const -> size_t { return workers_.size(); }
+
+    /**
+     * @brief Why workers could not be pinned as requested, e.g. a cpu outside of the process' cpuset. Those workers
+     * run wherever the OS schedules them
+     */
+    auto affinity_error() const -> const std::optional<Error>& { return affinity_error_; }
+
+private:
+    struct RunQueue {
+        std::mutex mutex;
+        std::deque<Strand*> strands;
+    };
+
+    void Schedule(Strand* strand);
+    auto Pop(size_t index) -> Strand*;
+    auto Remove(Strand* strand) -> bool;
+    void Worker(size_t index, std::stop_token stoken);
+
+    std::vector<std::unique_ptr<RunQueue>> queues_;
+    std::atomic<size_t> queued_;      // Strands in all run queues, what idle workers wait for
+    std::atomic<size_t> next_queue_;  // Round robin for strands scheduled from outside the pool
+    std::mutex idle_mutex_;
+    std::condition_variable_any work_cv_;
+    std::condition_variable idle_cv_;
+    std::optional<Error> affinity_error_;
+    std::vector<std::jthread> workers_;
+};
+
+}  // namespace oryx
@@ -0,0 +1,105 @@
+#include "frame_converter.hpp"
+
+#include <atomic>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+namespace oryx {
+
+namespace {
+
+// Rows of plane are subsampled by 1 << PlaneShift compared to the luma plane
+auto PlaneShift(const AVPixFmtDescriptor* desc, int plane) -> int {
+    for (int comp = 0; comp < desc->nb_components; comp++) {
+        if (desc->comp[comp].plane == plane) {
+            return comp == 1 || comp == 2 ? desc->log2_chroma_h : 0;
+        }
+    }
+    return 0;
+}
+
+}  // namespace
+
+FrameConverter::FrameConverter(size_t slices)
+    : contexts_(std::max<size_t>(slices, 1)),
+      workers_(std::make_unique<WorkerGroup>(contexts_.size())) {}
+
+auto FrameConverter::Convert(const AVFrame* src, AVFrame* dst, int flags) -> void_expected<av::Error> {
+    auto src_desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(src->format));
+    auto dst_desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(dst->format));
+    if (!src_desc || !dst_desc) {
+        return av::UnexpectedError(AVERROR(EINVAL));
+    }
+
+    if (src->width != dst->width || src->height != dst->height) {
+        return Scale(src, dst, flags);
+    }
+
+    // Every band has to start on a row where all chroma planes of both formats start a new row as well
+    const int align = 1 << std::max(src_desc->log2_chroma_h, dst_desc->log2_chroma_h);
+    const int max_slices = std::max(1, src->height / (align * 16));
+    const int slices = std::min(static_cast<int>(contexts_.size()), max_slices);
+    int slice_height = (src->height + slices - 1) / slices;
+    slice_height = (slice_height + align - 1) / align * align;
+
+    struct Job {
+        FrameConverter* self;
+        const AVFrame* src;
+        AVFrame* dst;
+        const AVPixFmtDescriptor* src_desc;
+        const AVPixFmtDescriptor* dst_desc;
+        int slice_height;
+        int flags;
+        std::atomic<int> error;
+    } job{this, src, dst, src_desc, dst_desc, slice_height, flags, 0};
+
+    const size_t count = (src->height + slice_height - 1) / slice_height;
+    workers_->Run(count, [job = &job](size_t index) {
+        const int y = static_cast<int>(index) * job->slice_height;
+        const int height = std::min(job->slice_height, job->src->height - y);
+        auto sws_ctx = av::UpdateSwsConvertFormatContext(job->self->contexts_[index], job->src->format,
+                                                         job->dst->format, ImageSize(job->src->width, height),
+                                                         job->flags);
+        if (!sws_ctx) {
+            job->error.store(AVERROR(EINVAL));
+            return;
+        }
+
+        const uint8_t* src_data[4]{};
+        uint8_t* dst_data[4]{};
+        for (int plane = 0; plane < 4; plane++) {
+            if (job->src->data[plane]) {
+                src_data[plane] =
+                    job->src->data[plane] + (y >> PlaneShift(job->src_desc, plane)) * job->src->linesize[plane];
+            }
+            if (job->dst->data[plane]) {
+                dst_data[plane] =
+                    job->dst->data[plane] + (y >> PlaneShift(job->dst_desc, plane)) * job->dst->linesize[plane];
+            }
+        }
+        sws_scale(sws_ctx, src_data, job->src->linesize, 0, height, dst_data, job->dst->linesize);
+    });
+
+    if (int error = job.error.load(); error < 0) {
+        return av::UnexpectedError(error);
+    }
+    return kVoidExpected;
+}
+
+auto FrameConverter::Scale(const AVFrame* src, AVFrame* dst, int flags) -> void_expected<av::Error> {
+    auto sws_ctx = av::UpdateSwsScaleContext(contexts_[0], ImageSize(src->width, src->height), src->format,
+                                             ImageSize(dst->width, dst->height), dst->format, flags);
+    if (!sws_ctx) {
+        return av::UnexpectedError(AVERROR(EINVAL));
+    }
+
+    sws_scale(sws_ctx, src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+    return kVoidExpected;
+}
+
+}  // namespace oryx
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <oryx/expected.hpp>
+
+#include "av_helpers.hpp"
+#include "av_error.hpp"
+#include "worker_group.hpp"
+
+namespace oryx {
+
+/**
+ * @brief Converts frames between pixel formats and sizes. With more than one slice a frame that keeps its size is cut
+ * into horizontal bands that are converted in parallel, each band with its own sws context. Scaling filters reach
+ * across band edges, so frames that change size are converted in one piece.
+ */
+class FrameConverter {
+public:
+    explicit FrameConverter(size_t slices);
+
+    /**
+     * @brief Converts and scales src into the already allocated dst in a single pass. Size and format are taken from
+     * both frames
+     */
+    auto Convert(const AVFrame* src, AVFrame* dst, int flags) -> void_expected<av::Error>;
+
+    auto slices() const -> size_t { return contexts_.size(); }
+
+private:
+    auto Scale(const AVFrame* src, AVFrame* dst, int flags) -> void_expected<av::Error>;
+
+    std::vector<av::UniqueSwsContextPtr> contexts_;
+    std::unique_ptr<WorkerGroup> workers_;
+};
+
+}  // namespace oryx
@@ -0,0 +1,93 @@
+#include "frame_timestamp.hpp"
+
+#include <cstring>
+
+namespace oryx {
+
+namespace {
+
+using Micros = std::chrono::microseconds;
+
+// 40 bits of microseconds followed by an 8 bit check so a damaged strip is rejected instead of misread
+constexpr int kTimeBits = 40;
+constexpr int kCheckBits = 8;
+constexpr int kBits = kTimeBits + kCheckBits;
+constexpr uint64_t kTimeMask = (uint64_t{1} << kTimeBits) - 1;
+
+auto Checksum(uint64_t value) -> uint64_t {
+    uint64_t sum = 0xa5;
+    for (int i = 0; i < kTimeBits; i += 8) {
+        sum ^= (value >> i) & 0xff;
+    }
+    return sum;
+}
+
+// Square blocks as wide as the strip allows, at least 4 pixels which is what survives 4:2:0 and the deblocking filter
+auto BlockSize(const Image& image) -> int {
+    const int block = image.cols / kBits;
+    return block >= 4 && image.rows >= block ? block : 0;
+}
+
+// Only luma carries the stamp, the chroma under the strip is whatever the source had. A single channel of a
+// decoded BGR pixel swings with that chroma, the weighted sum stays on the right side of the threshold
+auto Luma(const uint8_t* pixel, int channels) -> int {
+    if (channels < 3) {
+        return pixel[0];
+    }
+    return (29 * pixel[0] + 150 * pixel[1] + 77 * pixel[2]) >> 8;
+}
+
+}  // namespace
+
+void StampFrameTime(Image& image, std::chrono::system_clock::time_point time) {
+    const int block = BlockSize(image);
+    if (block == 0) {
+        return;
+    }
+
+    const auto micros = static_cast<uint64_t>(std::chrono::duration_cast<Micros>(time.time_since_epoch()).count());
+    const uint64_t value = micros & kTimeMask;
+    const uint64_t bits = value | (Checksum(value) << kTimeBits);
+
+    const size_t pixel_size = image.elemSize();
+    for (int y = 0; y < block; y++) {
+        auto row = image.ptr<uint8_t>(y);
+        for (int bit = 0; bit < kBits; bit++) {
+            const uint8_t level = (bits >> bit) & 1 ? 0xff : 0x00;
+            std::memset(row + static_cast<size_t>(bit * block) * pixel_size, level, block * pixel_size);
+        }
+    }
+}
+
+auto ReadFrameTime(const Image& image) -> std::optional<std::chrono::system_clock::time_point> {
+    const int block = BlockSize(image);
+    if (block == 0) {
+        return std::nullopt;
+    }
+
+    // The center of every block is furthest from the blur of its neighbours
+    const size_t pixel_size = image.elemSize();
+    auto row = image.ptr<uint8_t>(block / 2);
+    uint64_t bits{};
+    for (int bit = 0; bit < kBits; bit++) {
+        if (Luma(row + static_cast<size_t>(bit * block + block / 2) * pixel_size, image.channels()) >= 0x80) {
+            bits |= uint64_t{1} << bit;
+        }
+    }
+
+    const uint64_t value = bits & kTimeMask;
+    if ((bits >> kTimeBits) != Checksum(value)) {
+        return std::nullopt;
+    }
+
+    // Put the wrapped stamp back into the current epoch, a stamp from the future belongs to the previous wrap
+    const auto now = static_cast<uint64_t>(
+        std::chrono::duration_cast<Micros>(std::chrono::system_clock::now().time_since_epoch()).count());
+    uint64_t micros = (now & ~kTimeMask) | value;
+    if (micros > now) {
+        micros -= kTimeMask + 1;
+    }
+    return std::chrono::system_clock::time_point(Micros(micros));
+}
+
+}  // namespace oryx
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+
+#include "image.hpp"
+
+namespace oryx {
+
+/**
+ * @brief Burns time into the top rows of image as a strip of black and white blocks, one per bit, that survives
+ * encoding. image is either packed like BGR or starts with its luma plane like I420. Images narrower than
+ * kFrameTimestampMinWidth are left untouched
+ */
+void StampFrameTime(Image& image, std::chrono::system_clock::time_point time);
+
+/**
+ * @brief Time stamped by StampFrameTime. image is either packed like BGR or starts with its luma plane, packed pixels
+ * are read by their luma. Nullopt if image carries no intact stamp. Stamps wrap every 2^40 microseconds, about 12
+ * days, and are resolved to the wrap nearest before now
+ */
+auto ReadFrameTime(const Image& image) -> std::optional<std::chrono::system_clock::time_point>;
+
+inline constexpr int kFrameTimestampMinWidth = 192;
+
+}  // namespace oryx
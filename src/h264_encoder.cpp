@@ -1,12 +1,17 @@
 #include "h264_encoder.hpp"
 
 #include <cassert>
+#include <chrono>
+#include <algorithm>
+#include <string_view>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/opt.h>
+#include <libavutil/dict.h>
 }
 
 #include "av_error.hpp"
@@ -15,10 +20,137 @@ extern "C" {
 
 namespace oryx {
 
+namespace {
+
+// Picks format if codec can encode it directly, the codec's default 420 format otherwise
+auto SelectPixelFormat(const AVCodec* codec, PixelFormat format) -> AVPixelFormat {
+    auto wanted = static_cast<AVPixelFormat>(av::ToAVPixelFormat(format));
+    const AVPixelFormat* formats{};
+    int count{};
+    if (wanted == AV_PIX_FMT_NONE ||
+        avcodec_get_supported_config(nullptr, codec, AV_CODEC_CONFIG_PIX_FORMAT, 0,
+                                     reinterpret_cast<const void**>(&formats), &count) < 0 ||
+        !formats) {
+        return AV_PIX_FMT_YUV420P;
+    }
+    return std::find(formats, formats + count, wanted) != formats + count ? wanted : AV_PIX_FMT_YUV420P;
+}
+
+auto PresetName(H264Encoder::Preset preset, bool nvenc) -> const char* {
+    switch (preset) {
+        case H264Encoder::Preset::kDefault:
+            return nullptr;
+        case H264Encoder::Preset::kUltraFast:
+            return nvenc ? "p1" : "ultrafast";
+        case H264Encoder::Preset::kVeryFast:
+            return nvenc ? "p2" : "veryfast";
+        case H264Encoder::Preset::kFast:
+            return nvenc ? "p3" : "fast";
+        case H264Encoder::Preset::kMedium:
+            return nvenc ? "p4" : "medium";
+        case H264Encoder::Preset::kSlow:
+            return nvenc ? "p6" : "slow";
+    }
+    return nullptr;
+}
+
+// Translates profile into codec context fields and private options of libx264 or nvenc. Options the selected
+// encoder does not know are left in the dictionary and ignored by avcodec_open2
+void ApplyProfile(const H264Encoder::Profile& profile, bool nvenc, AVCodecContext* ctx, AVDictionary** options) {
+    if (auto preset = PresetName(profile.preset, nvenc)) {
+        av_dict_set(options, "preset", preset, 0);
+    }
+
+    if (profile.tune == H264Encoder::Tune::kZeroLatency) {
+        if (nvenc) {
+            av_dict_set(options, "tune", "ull", 0);
+            av_dict_set(options, "zerolatency", "1", 0);
+            av_dict_set(options, "delay", "0", 0);
+        } else {
+            av_dict_set(options, "tune", "zerolatency", 0);
+        }
+    }
+
+    const int64_t bitrate = ctx->bit_rate;
+    auto vbv_buffer = profile.vbv_buffer;
+    switch (profile.rate_control) {
+        case H264Encoder::RateControl::kAbr:
+            break;
+        case H264Encoder::RateControl::kCbr:
+            ctx->rc_max_rate = bitrate;
+            ctx->rc_min_rate = bitrate;
+            av_dict_set(options, nvenc ? "rc" : "nal-hrd", "cbr", 0);
+            if (vbv_buffer.count() <= 0) {
+                // CBR needs a vbv
+                vbv_buffer = std::chrono::seconds(1);
+            }
+            break;
+        case H264Encoder::RateControl::kCrf:
+            // Both encoders switch to average bitrate as soon as one is set. It only caps the rate with a vbv
+            ctx->bit_rate = 0;
+            if (nvenc) {
+                av_dict_set(options, "rc", "vbr", 0);
+                av_dict_set_int(options, "cq", profile.crf, 0);
+            } else {
+                av_dict_set_int(options, "crf", profile.crf, 0);
+            }
+            break;
+    }
+
+    if (vbv_buffer.count() > 0) {
+        ctx->rc_buffer_size = static_cast<int>(bitrate * vbv_buffer.count() / 1000);
+        if (!ctx->rc_max_rate) {
+            ctx->rc_max_rate = bitrate;
+        }
+    }
+
+    if (profile.intra_refresh) {
+        av_dict_set(options, "intra-refresh", "1", 0);
+    }
+
+    if (profile.lookahead > 0) {
+        av_dict_set_int(options, "rc-lookahead", profile.lookahead, 0);
+    }
+
+    ctx->max_b_frames = profile.max_b_frames;
+    ctx->thread_count = profile.threads;
+    if (profile.slices > 0) {
+        ctx->slices = profile.slices;
+        ctx->thread_type = FF_THREAD_SLICE;
+    }
+}
+
+}  // namespace
+
+auto H264Encoder::Profile::LowLatency() -> Profile {
+    return Profile{
+        .preset = Preset::kVeryFast,
+        .tune = Tune::kZeroLatency,
+        .rate_control = RateControl::kCbr,
+        .vbv_buffer = std::chrono::milliseconds(250),
+        .threads = 0,
+        .slices = 4,
+    };
+}
+
+auto H264Encoder::Profile::HighThroughput() -> Profile {
+    return Profile{
+        .preset = Preset::kVeryFast,
+        .rate_control = RateControl::kAbr,
+        .max_b_frames = 2,
+        .lookahead = 40,
+        .threads = 0,
+    };
+}
+
 H264Encoder::H264Encoder()
     : codec_ctx_(),
       sws_ctx_(),
-      frame_(av::MakeUniqueFrame()) {}
+      frame_(av::MakeUniqueFrame()),
+      input_frame_(av::MakeUniqueFrame()),
+      packet_pool_(av::PacketPool::Create()),
+      next_pts_(),
+      metrics_() {}
 
 H264Encoder::~H264Encoder() { Close(); }
 
@@ -39,29 +171,24 @@ auto H264Encoder::Open(Settings settings) -> void_expected<av::Error> {
     codec_ctx_->height = settings.size.height;
     codec_ctx_->time_base = AVRational{1, settings.frame_rate};
     codec_ctx_->framerate = AVRational{settings.frame_rate, 1};
-    codec_ctx_->gop_size = 5;
-    codec_ctx_->max_b_frames = 0;
-    codec_ctx_->pix_fmt = AV_PIX_FMT_YUV420P;
+    codec_ctx_->gop_size = settings.profile.keyframe_interval > 0 ? settings.profile.keyframe_interval
+                                                                  : settings.frame_rate * 2;
+    codec_ctx_->pix_fmt = SelectPixelFormat(codec, settings.input_format);
+
+    AVDictionary* options = nullptr;
+    ApplyProfile(settings.profile, std::string_view(codec->name) == "h264_nvenc", codec_ctx_.get(), &options);
 
-    int ret = avcodec_open2(codec_ctx_.get(), codec, nullptr);
+    int ret = avcodec_open2(codec_ctx_.get(), codec, &options);
+    av_dict_free(&options);
     if (ret < 0) {
         return av::UnexpectedError(ret);
     }
 
+    av_frame_unref(frame_.get());
     frame_->format = codec_ctx_->pix_fmt;
     frame_->width = settings.size.width;
     frame_->height = settings.size.height;
-    frame_->pts = 0;
-
-    ret = av_frame_get_buffer(frame_.get(), 0);
-    if (ret < 0) {
-        return av::UnexpectedError(ret);
-    }
-
-    sws_ctx_ = av::GetSwsConvertFormatContext(AV_PIX_FMT_BGR24, codec_ctx_->pix_fmt, settings.size, SWS_BILINEAR);
-    if (!sws_ctx_) {
-        return av::UnexpectedError(ret);
-    }
+    next_pts_ = 0;
     return kVoidExpected;
 }
 
@@ -71,43 +198,130 @@ void H264Encoder::Close() {
 }
 
 auto H264Encoder::Encode(const Image& image, OnPacketFn on_packet) -> void_expected<av::Error> {
-    assert(frame_ && kMissingInitMessage);
+    return Encode(image, PixelFormat::kBgr24, std::move(on_packet));
+}
+
+auto H264Encoder::Encode(const Image& image, PixelFormat format, OnPacketFn on_packet) -> void_expected<av::Error> {
+    assert(codec_ctx_ && kMissingInitMessage);
+
+    if (!on_packet) {
+        return UnexpectedError("Packet callback is invalid");
+    }
+
+    auto pix_fmt = av::ToAVPixelFormat(format);
+    if (pix_fmt == AV_PIX_FMT_NONE) {
+        return UnexpectedError("Input pixel format has to be explicit");
+    }
+
+    // Hand the image's memory to the encoder, or the conversion if the encoder runs in another format. The encoder
+    // copies what it keeps while the frame is submitted
+    auto input = input_frame_.get();
+    int ret = av::WrapImage(image, ImageSize(codec_ctx_->width, codec_ctx_->height), pix_fmt, input);
+    if (ret < 0) {
+        av_frame_unref(input);
+        return av::UnexpectedError(ret);
+    }
+
+    void_expected<av::Error> result;
+    if (pix_fmt != codec_ctx_->pix_fmt) {
+        result = Convert(input->data, input->linesize, pix_fmt);
+        if (result) {
+            result = Send(frame_.get(), on_packet);
+        }
+    } else {
+        result = Send(input, on_packet);
+    }
+    av_frame_unref(input);
+    return result;
+}
+
+auto H264Encoder::Encode(const AVFrame* frame, OnPacketFn on_packet) -> void_expected<av::Error> {
     assert(codec_ctx_ && kMissingInitMessage);
-    assert(sws_ctx_ && kMissingInitMessage);
 
     if (!on_packet) {
         return UnexpectedError("Packet callback is invalid");
     }
 
-    int ret = av_frame_make_writable(frame_.get());
+    if (frame->width != codec_ctx_->width || frame->height != codec_ctx_->height) {
+        return UnexpectedError("Frame size differs from the encoder's");
+    }
+
+    if (frame->format != codec_ctx_->pix_fmt) {
+        auto result = Convert(frame->data, frame->linesize, frame->format);
+        if (!result) {
+            return result;
+        }
+        return Send(frame_.get(), on_packet);
+    }
+
+    auto input = input_frame_.get();
+    int ret = av_frame_ref(input, frame);
     if (ret < 0) {
         return av::UnexpectedError(ret);
     }
 
-    const uint8_t* frame_slice[] = {image.data};
-    int frame_stride[] = {static_cast<int>(image.step)};
+    auto result = Send(input, on_packet);
+    av_frame_unref(input);
+    return result;
+}
+
+auto H264Encoder::Convert(const uint8_t* const data[], const int linesize[], int pix_fmt)
+    -> void_expected<av::Error> {
+    assert(frame_ && kMissingInitMessage);
+
+    const ImageSize size(codec_ctx_->width, codec_ctx_->height);
+    auto sws_ctx = av::UpdateSwsConvertFormatContext(sws_ctx_, pix_fmt, codec_ctx_->pix_fmt, size, SWS_BILINEAR);
+    if (!sws_ctx) {
+        return UnexpectedError("Failed to create sws context");
+    }
+
+    int ret = frame_->buf[0] ? av_frame_make_writable(frame_.get()) : av_frame_get_buffer(frame_.get(), 0);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    sws_scale(sws_ctx, data, linesize, 0, size.height, frame_->data, frame_->linesize);
+    metrics_.convert_time.Record(std::chrono::steady_clock::now() - start);
+    return kVoidExpected;
+}
+
+auto H264Encoder::Send(AVFrame* frame, const OnPacketFn& on_packet) -> void_expected<av::Error> {
+    using Clock = std::chrono::steady_clock;
+
     auto codec_ctx_ptr = codec_ctx_.get();
-    sws_scale(sws_ctx_.get(), frame_slice, frame_stride, 0, codec_ctx_ptr->height, frame_->data, frame_->linesize);
+    frame->pts = next_pts_;
 
-    ret = avcodec_send_frame(codec_ctx_ptr, frame_.get());
+    // Encode time leaves out handing packets to on_packet
+    auto start = Clock::now();
+    Clock::duration encode_time{};
+    int ret = avcodec_send_frame(codec_ctx_ptr, frame);
     if (ret < 0) {
         return av::UnexpectedError(ret);
     }
 
-    frame_->pts++;
+    next_pts_++;
+    metrics_.frames.Add();
 
+    // The packet of the final EAGAIN round simply goes back to the pool
+    auto packet = packet_pool_->Acquire();
     while (ret >= 0) {
-        auto packet = av::MakeUniquePacket();
         ret = avcodec_receive_packet(codec_ctx_ptr, packet.get());
+        encode_time += Clock::now() - start;
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            metrics_.encode_time.Record(encode_time);
             return kVoidExpected;
         } else if (ret < 0) {
             return av::UnexpectedError(ret);
         } else {
+            metrics_.packets.Add();
+            metrics_.bytes.Add(packet->size);
             on_packet(std::move(packet));
+            packet = packet_pool_->Acquire();
+            start = Clock::now();
         }
     }
     return kVoidExpected;
 }
 
-}  // namespace oryx
\ No newline at end of file
+}  // namespace oryx
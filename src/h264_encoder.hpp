@@ -1,10 +1,12 @@
 #pragma once
 
+#include <chrono>
 #include <functional>
 
 #include "image.hpp"
 #include "av_helpers.hpp"
 #include "av_error.hpp"
+#include "metrics.hpp"
 
 namespace oryx {
 
@@ -12,10 +14,62 @@ class H264Encoder {
 public:
     using OnPacketFn = std::function<void(av::UniquePacketPtr)>;
 
+    /**
+     * @brief Speed over compression trade off. Mapped to libx264's presets and nvenc's p1 to p7
+     */
+    enum class Preset {
+        kDefault,  // Whatever the encoder defaults to
+        kUltraFast,
+        kVeryFast,
+        kFast,
+        kMedium,
+        kSlow,
+    };
+
+    enum class Tune {
+        kDefault,
+        kZeroLatency,  // No lookahead and no frame threading delay. nvenc's ultra low latency tuning
+    };
+
+    enum class RateControl {
+        kAbr,  // Average bitrate, may burst above it
+        kCbr,  // Constant bitrate with a filler padded vbv, best for constrained links
+        kCrf,  // Constant quality, bitrate follows the content
+    };
+
+    /**
+     * @brief Encoder tuning. The defaults leave everything to the encoder except for a keyframe every two seconds
+     */
+    struct Profile {
+        Preset preset{Preset::kDefault};
+        Tune tune{Tune::kDefault};
+        RateControl rate_control{RateControl::kAbr};
+        int crf{23};                             // Quality for kCrf, lower is better
+        std::chrono::milliseconds vbv_buffer{};  // Rate control buffer in time at bitrate, 0 leaves it to the encoder
+        int keyframe_interval{};                 // In frames, 0 uses two seconds
+        int max_b_frames{};                      // B frames add latency of as many frames
+        int lookahead{};                         // Rate control lookahead in frames, 0 leaves it to the encoder
+        int threads{1};                          // 0 lets the encoder decide, which may frame thread and add delay
+        int slices{};                            // Slices per frame. Non zero threads on slices instead of frames
+        bool intra_refresh{};  // Periodic intra refresh instead of keyframes. Smooth bitrate but late joiners wait
+
+        /**
+         * @brief Lowest glass to glass latency. Zero latency tuning, CBR with a short vbv and slice threads
+         */
+        static auto LowLatency() -> Profile;
+
+        /**
+         * @brief Least cpu per stream. Automatic frame threads, a longer lookahead and b frames at the cost of latency
+         */
+        static auto HighThroughput() -> Profile;
+    };
+
     struct Settings {
         ImageSize size;
         int frame_rate;
         int bitrate;
+        PixelFormat input_format{PixelFormat::kBgr24};  // Opens the encoder in this format if supported
+        Profile profile{};
     };
 
     H264Encoder();
@@ -24,13 +78,39 @@ public:
     auto Open(Settings settings) -> void_expected<av::Error>;
     void Close();
 
+    /**
+     * @brief Encodes a BGR image
+     */
     auto Encode(const Image& image, OnPacketFn on_packet) -> void_expected<av::Error>;
+
+    /**
+     * @brief Encodes image holding format. Planar formats are expected as one continuous image with the planes
+     * following each other, like OpenCV's I420 layout. Images already in the encoder's format are passed to the
+     * encoder without conversion or copy and only have to stay valid until the call returns
+     */
+    auto Encode(const Image& image, PixelFormat format, OnPacketFn on_packet) -> void_expected<av::Error>;
+
+    /**
+     * @brief Encodes frame, e.g. a decoded one. Reference counted frames in the encoder's format are passed on by
+     * reference, other formats are converted. The size has to match. The frame's pts is ignored, frames are numbered
+     * in submit order
+     */
+    auto Encode(const AVFrame* frame, OnPacketFn on_packet) -> void_expected<av::Error>;
+
     auto codec_ctx() { return codec_ctx_.get(); }
+    auto stats() const -> EncoderStats { return metrics_.Snapshot(); }
 
 private:
+    auto Convert(const uint8_t* const data[], const int linesize[], int pix_fmt) -> void_expected<av::Error>;
+    auto Send(AVFrame* frame, const OnPacketFn& on_packet) -> void_expected<av::Error>;
+
     av::UniqueCodecContextPtr codec_ctx_;
     av::UniqueSwsContextPtr sws_ctx_;
-    av::UniqueFramePtr frame_;
+    av::UniqueFramePtr frame_;        // Conversion target, buffers are allocated on first use
+    av::UniqueFramePtr input_frame_;  // References input that needs no conversion
+    std::shared_ptr<av::PacketPool> packet_pool_;
+    int64_t next_pts_;
+    EncoderMetrics metrics_;
 };
 
 }  // namespace oryx
\ No newline at end of file
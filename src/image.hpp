@@ -13,6 +13,17 @@ struct ImageSize {
     auto operator==(const ImageSize& size) const -> bool = default;
 };
 
+/**
+ * @brief Pixel formats frames can be delivered or encoded in
+ */
+enum class PixelFormat {
+    kNative,  // Whatever the decoder produces, no conversion
+    kBgr24,
+    kGray8,
+    kYuv420p,
+    kNv12,
+};
+
 using ByteVector = std::vector<uint8_t>;
 using Image = cv::Mat;
 
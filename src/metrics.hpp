@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace oryx {
+
+/**
+ * @brief Monotonic counter. Relaxed atomics only, readers see a recent value
+ */
+class Counter {
+public:
+    void Add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    auto value() const -> uint64_t { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{};
+};
+
+namespace detail {
+
+// Concurrent writers may race, a plain load and store would let a smaller value overwrite a larger one
+inline void StoreMax(std::atomic<uint64_t>& max, uint64_t value) {
+    auto current = max.load(std::memory_order_relaxed);
+    while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+}  // namespace detail
+
+/**
+ * @brief Current value and the highest value seen
+ */
+class Gauge {
+public:
+    void Set(uint64_t value) {
+        value_.store(value, std::memory_order_relaxed);
+        detail::StoreMax(max_, value);
+    }
+
+    auto value() const -> uint64_t { return value_.load(std::memory_order_relaxed); }
+    auto max() const -> uint64_t { return max_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{};
+    std::atomic<uint64_t> max_{};
+};
+
+struct HistogramSnapshot {
+    static constexpr size_t kBucketCount = 32;
+
+    std::array<uint64_t, kBucketCount> buckets;  // Bucket i counts durations below 2^i microseconds
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+
+    auto mean() const -> std::chrono::nanoseconds { return std::chrono::nanoseconds(count ? sum_ns / count : 0); }
+
+    /**
+     * @brief Upper bound of the bucket holding the p quantile, p in [0, 1]
+     */
+    auto Percentile(double p) const -> std::chrono::nanoseconds {
+        if (count == 0) {
+            return {};
+        }
+        const auto rank = static_cast<uint64_t>(p * static_cast<double>(count));
+        uint64_t seen{};
+        for (size_t i = 0; i < kBucketCount; i++) {
+            seen += buckets[i];
+            if (seen > rank || seen == count) {
+                return std::min(std::chrono::nanoseconds(std::chrono::microseconds(uint64_t{1} << i)),
+                                std::chrono::nanoseconds(max_ns));
+            }
+        }
+        return std::chrono::nanoseconds(max_ns);
+    }
+};
+
+/**
+ * @brief Duration histogram with power of two microsecond buckets. Recording is a few relaxed atomic adds, readers
+ * take a snapshot while it is being written
+ */
+class Histogram {
+public:
+    void Record(std::chrono::nanoseconds duration) {
+        const auto ns = static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0));
+        const auto index = std::min<size_t>(std::bit_width(ns / 1000), HistogramSnapshot::kBucketCount - 1);
+        buckets_[index].fetch_add(1, std::memory_order_relaxed);
+        sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+        detail::StoreMax(max_ns_, ns);
+    }
+
+    auto Snapshot() const -> HistogramSnapshot {
+        HistogramSnapshot snapshot{};
+        for (size_t i = 0; i < buckets_.size(); i++) {
+            snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+            snapshot.count += snapshot.buckets[i];
+        }
+        snapshot.sum_ns = sum_ns_.load(std::memory_order_relaxed);
+        snapshot.max_ns = max_ns_.load(std::memory_order_relaxed);
+        return snapshot;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, HistogramSnapshot::kBucketCount> buckets_{};
+    std::atomic<uint64_t> sum_ns_{};
+    std::atomic<uint64_t> max_ns_{};
+};
+
+/**
+ * @brief Keeps every recorded duration for exact percentiles where Histogram's power of two buckets are too coarse,
+ * like comparing latency across settings. Memory grows with the samples until they are taken
+ */
+class SampleRecorder {
+public:
+    void Record(std::chrono::nanoseconds duration) {
+        std::lock_guard lock(mutex_);
+        samples_.push_back(duration);
+    }
+
+    /**
+     * @brief Samples recorded since the last call, sorted
+     */
+    auto Take() -> std::vector<std::chrono::nanoseconds> {
+        std::vector<std::chrono::nanoseconds> samples;
+        {
+            std::lock_guard lock(mutex_);
+            samples = std::exchange(samples_, {});
+        }
+        std::ranges::sort(samples);
+        return samples;
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::chrono::nanoseconds> samples_;
+};
+
+/**
+ * @brief Nearest rank p quantile of sorted samples, p in [0, 1]
+ */
+inline auto Percentile(const std::vector<std::chrono::nanoseconds>& sorted, double p) -> std::chrono::nanoseconds {
+    if (sorted.empty()) {
+        return {};
+    }
+    const auto rank = static_cast<size_t>(p * static_cast<double>(sorted.size()));
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+/**
+ * @brief Counters of one ingest session, read at any time through Snapshot
+ */
+struct SessionStats {
+    uint64_t packets_read;
+    uint64_t bytes_read;
+    uint64_t queue_depth;
+    uint64_t queue_high_water;
+    uint64_t dropped_packets;
+    uint64_t decoded_frames;
+    uint64_t decimated_frames;       // Packets or frames skipped by the decimation setting
+    HistogramSnapshot decode_time;   // avcodec send and receive per packet
+    HistogramSnapshot convert_time;  // Pixel format conversion per frame
+    HistogramSnapshot handler_time;  // Spent in the packet, image and frame handlers
+    HistogramSnapshot latency;       // From reading a packet to handing its frame to the handlers
+    HistogramSnapshot first_image;   // From accepting a publisher to its first image, one sample per connection
+};
+
+struct SessionMetrics {
+    auto Snapshot() const -> SessionStats {
+        return SessionStats{
+            .packets_read = packets_read.value(),
+            .bytes_read = bytes_read.value(),
+            .queue_depth = queue_depth.value(),
+            .queue_high_water = queue_depth.max(),
+            .dropped_packets = dropped_packets.value(),
+            .decoded_frames = decoded_frames.value(),
+            .decimated_frames = decimated_frames.value(),
+            .decode_time = decode_time.Snapshot(),
+            .convert_time = convert_time.Snapshot(),
+            .handler_time = handler_time.Snapshot(),
+            .latency = latency.Snapshot(),
+            .first_image = first_image.Snapshot(),
+        };
+    }
+
+    Counter packets_read;
+    Counter bytes_read;
+    Gauge queue_depth;
+    Counter dropped_packets;
+    Counter decoded_frames;
+    Counter decimated_frames;
+    Histogram decode_time;
+    Histogram convert_time;
+    Histogram handler_time;
+    Histogram latency;
+    Histogram first_image;
+};
+
+/**
+ * @brief Counters of an encoder, read at any time through Snapshot
+ */
+struct EncoderStats {
+    uint64_t frames;
+    uint64_t packets;
+    uint64_t bytes;
+    HistogramSnapshot encode_time;   // avcodec send and receive per frame
+    HistogramSnapshot convert_time;  // Pixel format conversion per frame
+};
+
+struct EncoderMetrics {
+    auto Snapshot() const -> EncoderStats {
+        return EncoderStats{
+            .frames = frames.value(),
+            .packets = packets.value(),
+            .bytes = bytes.value(),
+            .encode_time = encode_time.Snapshot(),
+            .convert_time = convert_time.Snapshot(),
+        };
+    }
+
+    Counter frames;
+    Counter packets;
+    Counter bytes;
+    Histogram encode_time;
+    Histogram convert_time;
+};
+
+}  // namespace oryx
@@ -0,0 +1,164 @@
+#include "rendition_encoder.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+
+namespace oryx {
+
+namespace {
+
+// Renditions are encoded from yuv420p, which every h264 encoder takes without converting
+constexpr AVPixelFormat kRenditionFormat = AV_PIX_FMT_YUV420P;
+
+}  // namespace
+
+RenditionEncoder::RenditionEncoder()
+    : size_(),
+      renditions_(),
+      workers_(),
+      source_(av::MakeUniqueFrame()) {}
+
+RenditionEncoder::~RenditionEncoder() { Close(); }
+
+auto RenditionEncoder::Open(Settings settings) -> void_expected<av::Error> {
+    if (settings.renditions.empty()) {
+        return UnexpectedError("At least one rendition is required");
+    }
+
+    Close();
+    size_ = settings.size;
+    for (const auto& rendition : settings.renditions) {
+        auto state = std::make_unique<State>();
+        state->frame = av::MakeUniqueFrame();
+        state->referenced = false;
+
+        H264Encoder::Settings encoder_settings;
+        encoder_settings.size = rendition.size;
+        encoder_settings.frame_rate = settings.frame_rate;
+        encoder_settings.bitrate = rendition.bitrate;
+        encoder_settings.input_format = PixelFormat::kYuv420p;
+        encoder_settings.profile = settings.profile;
+
+        auto result = state->encoder.Open(encoder_settings);
+        if (!result) {
+            Close();
+            return result;
+        }
+        renditions_.push_back(std::move(state));
+    }
+
+    const size_t threads = settings.threads > 0 ? settings.threads : renditions_.size();
+    workers_ = std::make_unique<WorkerGroup>(threads);
+    return kVoidExpected;
+}
+
+void RenditionEncoder::Close() {
+    workers_.reset();
+    renditions_.clear();
+}
+
+auto RenditionEncoder::Encode(const Image& image, PixelFormat format, const OnPacketFn& on_packet)
+    -> void_expected<av::Error> {
+    auto pix_fmt = av::ToAVPixelFormat(format);
+    if (pix_fmt == AV_PIX_FMT_NONE) {
+        return UnexpectedError("Input pixel format has to be explicit");
+    }
+
+    auto source = source_.get();
+    int ret = av::WrapImage(image, size_, pix_fmt, source);
+    if (ret < 0) {
+        av_frame_unref(source);
+        return av::UnexpectedError(ret);
+    }
+
+    auto result = Encode(source, on_packet);
+    av_frame_unref(source);
+    return result;
+}
+
+auto RenditionEncoder::Encode(const AVFrame* frame, const OnPacketFn& on_packet) -> void_expected<av::Error> {
+    if (!on_packet) {
+        return UnexpectedError("Packet callback is invalid");
+    }
+
+    // Scaling down the ladder is sequential but cheap compared to encoding
+    const AVFrame* parent = frame;
+    for (auto& state : renditions_) {
+        auto result = Scale(parent, *state);
+        if (!result) {
+            return result;
+        }
+        parent = state->frame.get();
+    }
+
+    workers_->Run(renditions_.size(), [this](size_t index) { EncodeRendition(index); });
+
+    void_expected<av::Error> result = kVoidExpected;
+    for (size_t i = 0; i < renditions_.size(); i++) {
+        auto& state = *renditions_[i];
+        // Don't hold on to the caller's frame or keep a larger rendition's buffer from being reused
+        if (state.referenced) {
+            av_frame_unref(state.frame.get());
+        }
+        for (auto& packet : state.packets) {
+            on_packet(i, std::move(packet));
+        }
+        state.packets.clear();
+        if (!state.result && result) {
+            result = std::unexpected(std::move(state.result.error()));
+        }
+    }
+    return result;
+}
+
+auto RenditionEncoder::Scale(const AVFrame* src, State& state) -> void_expected<av::Error> {
+    auto dst = state.frame.get();
+    auto codec_ctx = state.encoder.codec_ctx();
+    const ImageSize src_size(src->width, src->height);
+    const ImageSize dst_size(codec_ctx->width, codec_ctx->height);
+
+    // Nothing to scale, hand the encoder a reference
+    state.referenced = src_size == dst_size && src->format == kRenditionFormat;
+    if (state.referenced) {
+        av_frame_unref(dst);
+        int ret = av_frame_ref(dst, src);
+        if (ret < 0) {
+            return av::UnexpectedError(ret);
+        }
+        return kVoidExpected;
+    }
+
+    auto sws_ctx = av::UpdateSwsScaleContext(state.sws_ctx, src_size, src->format, dst_size, kRenditionFormat,
+                                             SWS_BILINEAR);
+    if (!sws_ctx) {
+        return UnexpectedError("Failed to create sws context");
+    }
+
+    int ret{};
+    if (dst->buf[0] && dst->width == dst_size.width && dst->format == kRenditionFormat) {
+        ret = av_frame_make_writable(dst);
+    } else {
+        av_frame_unref(dst);
+        dst->format = kRenditionFormat;
+        dst->width = dst_size.width;
+        dst->height = dst_size.height;
+        ret = av_frame_get_buffer(dst, 0);
+    }
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+
+    sws_scale(sws_ctx, src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+    return kVoidExpected;
+}
+
+void RenditionEncoder::EncodeRendition(size_t index) {
+    auto& state = *renditions_[index];
+    state.result = state.encoder.Encode(state.frame.get(), [&state](av::UniquePacketPtr packet) {
+        state.packets.push_back(std::move(packet));
+    });
+}
+
+}  // namespace oryx
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <functional>
+
+#include <oryx/expected.hpp>
+
+#include "av_helpers.hpp"
+#include "av_error.hpp"
+#include "h264_encoder.hpp"
+#include "worker_group.hpp"
+
+namespace oryx {
+
+/**
+ * @brief Encodes one source into several renditions of an adaptive bitrate ladder in a single pass. Every rendition
+ * is scaled once from the next larger one and the renditions encode in parallel.
+ */
+class RenditionEncoder {
+public:
+    using OnPacketFn = std::function<void(size_t rendition, av::UniquePacketPtr packet)>;
+
+    struct Rendition {
+        ImageSize size;
+        int bitrate;
+    };
+
+    struct Settings {
+        ImageSize size;  // Of the source
+        int frame_rate;
+        H264Encoder::Profile profile{};
+        std::vector<Rendition> renditions;  // Largest first, each is scaled from the one before
+        size_t threads{};                   // Threads encoding in parallel including the caller, 0 uses one each
+    };
+
+    RenditionEncoder();
+    ~RenditionEncoder();
+
+    auto Open(Settings settings) -> void_expected<av::Error>;
+    void Close();
+
+    /**
+     * @brief Encodes image holding format into every rendition. See H264Encoder::Encode for the expected layout
+     */
+    auto Encode(const Image& image, PixelFormat format, const OnPacketFn& on_packet) -> void_expected<av::Error>;
+
+    /**
+     * @brief Encodes frame into every rendition. on_packet is called on the calling thread once all renditions
+     * finished, in rendition order
+     */
+    auto Encode(const AVFrame* frame, const OnPacketFn& on_packet) -> void_expected<av::Error>;
+
+    auto codec_ctx(size_t rendition) { return renditions_[rendition]->encoder.codec_ctx(); }
+    auto stats(size_t rendition) const -> EncoderStats { return renditions_[rendition]->encoder.stats(); }
+    auto size() const -> size_t { return renditions_.size(); }
+
+private:
+    struct State {
+        H264Encoder encoder;
+        av::UniqueSwsContextPtr sws_ctx;
+        av::UniqueFramePtr frame;  // Input of the encoder, scaled or a reference of the larger rendition
+        bool referenced;
+        std::vector<av::UniquePacketPtr> packets;
+        void_expected<av::Error> result;
+    };
+
+    auto Scale(const AVFrame* src, State& state) -> void_expected<av::Error>;
+    void EncodeRendition(size_t index);
+
+    ImageSize size_;
+    std::vector<std::unique_ptr<State>> renditions_;
+    std::unique_ptr<WorkerGroup> workers_;
+    av::UniqueFramePtr source_;
+};
+
+}  // namespace oryx
@@ -0,0 +1,139 @@
+#include "rtmp_multi_server.hpp"
+
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/error.h>
+}
+
+#include "rtmp_session.hpp"
+
+namespace oryx {
+
+RtmpMultiServer::RtmpMultiServer(Settings settings)
+    : settings_(std::move(settings)),
+      decode_pool_(std::make_unique<DecodePool>(DecodePool::Settings{.thread_count = settings_.decode_threads,
+                                                                     .cpus = settings_.decode_cpus,
+                                                                     .numa_node = settings_.decode_numa_node})),
+      on_session_(),
+      on_error_(),
+      sessions_mutex_(),
+      sessions_cv_(),
+      sessions_(),
+      next_session_id_(),
+      accept_worker_() {}
+
+RtmpMultiServer::~RtmpMultiServer() { Stop(); }
+
+void RtmpMultiServer::Start() {
+    if (!accept_worker_) {
+        // The pool pins its threads when constructed, before an error handler could be set
+        if (const auto& error = decode_pool_->affinity_error()) {
+            SubmitError(Error(*error));
+        }
+        accept_worker_ = std::make_unique<std::jthread>([this](std::stop_token stoken) { AcceptWorker(stoken); });
+    }
+}
+
+void RtmpMultiServer::Stop() {
+    accept_worker_.reset();
+
+    std::list<std::unique_ptr<Session>> sessions;
+    {
+        std::lock_guard lock(sessions_mutex_);
+        sessions.swap(sessions_);
+    }
+    // Joins the readers outside of the lock, they take it on their way out
+    sessions.clear();
+}
+
+void RtmpMultiServer::SetSessionHandler(OnSessionFn on_session) { on_session_ = std::move(on_session); }
+void RtmpMultiServer::SetErrorHandler(OnErrorFn on_error) { on_error_ = std::move(on_error); }
+
+auto RtmpMultiServer::session_count() const -> size_t {
+    std::lock_guard lock(sessions_mutex_);
+    return std::ranges::count_if(sessions_, [](const auto& session) { return !session->done; });
+}
+
+auto RtmpMultiServer::stats() const -> std::vector<std::pair<SessionInfo, SessionStats>> {
+    std::vector<std::pair<SessionInfo, SessionStats>> stats;
+    std::lock_guard lock(sessions_mutex_);
+    for (const auto& session : sessions_) {
+        if (!session->done) {
+            stats.emplace_back(session->info, session->session->stats());
+        }
+    }
+    return stats;
+}
+
+void RtmpMultiServer::SubmitError(Error&& error) const {
+    if (on_error_) {
+        on_error_(std::move(error));
+    }
+}
+
+void RtmpMultiServer::ReapSessions() {
+    std::list<std::unique_ptr<Session>> done;
+    {
+        std::lock_guard lock(sessions_mutex_);
+        for (auto it = sessions_.begin(); it != sessions_.end();) {
+            auto next = std::next(it);
+            if ((*it)->done) {
+                done.splice(done.end(), sessions_, it);
+            }
+            it = next;
+        }
+    }
+    // Joins the finished readers and frees their decoders outside of the lock
+}
+
+void RtmpMultiServer::AcceptWorker(std::stop_token stoken) {
+    while (!stoken.stop_requested()) {
+        // Every iteration, finished sessions would otherwise keep their thread and decoder until we hit capacity
+        ReapSessions();
+        {
+            std::unique_lock lock(sessions_mutex_);
+            auto has_capacity = [this] {
+                return settings_.max_sessions == 0 ||
+                       std::ranges::count_if(sessions_, [](const auto& session) { return !session->done; }) <
+                           static_cast<std::ptrdiff_t>(settings_.max_sessions);
+            };
+            if (!sessions_cv_.wait(lock, stoken, has_capacity)) {
+                return;
+            }
+        }
+        ReapSessions();
+
+        // libavformat closes the listen socket once a client got accepted, so the next Accept can bind the same
+        // url right away while the accepted session keeps its connection
+        auto connection = RtmpSession::Accept(settings_.session, stoken);
+        if (!connection) {
+            if (connection.error().error_code() != AVERROR_EXIT) SubmitError(std::move(connection.error()));
+            continue;
+        }
+
+        auto session = std::make_unique<Session>();
+        session->info.id = next_session_id_++;
+        session->info.stream_key = connection->stream_key;
+        if (on_session_) {
+            session->handlers = on_session_(session->info);
+        }
+        session->session = std::make_unique<RtmpSession>(settings_.session, session->handlers, decode_pool_.get());
+        session->done = false;
+
+        auto raw = session.get();
+        session->reader = std::jthread([this, raw, connection = std::move(*connection)](std::stop_token st) mutable {
+            raw->session->Run(std::move(connection), st);
+            {
+                std::lock_guard lock(sessions_mutex_);
+                raw->done = true;
+            }
+            sessions_cv_.notify_all();
+        });
+
+        std::lock_guard lock(sessions_mutex_);
+        sessions_.push_back(std::move(session));
+    }
+}
+
+}  // namespace oryx
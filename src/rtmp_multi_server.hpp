@@ -0,0 +1,84 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include "rtmp_server.hpp"
+#include "decode_pool.hpp"
+
+namespace oryx {
+
+class RtmpSession;
+
+/**
+ * @brief RTMP server accepting many concurrent publishers on one listen url. Every publisher gets its own session
+ * with its own decode pipeline. Sessions only own a reader thread, decoding runs on a shared pool.
+ */
+class RtmpMultiServer {
+public:
+    struct Settings {
+        RtmpServer::Settings session;
+        size_t max_sessions;
+        size_t decode_threads;         // 0 uses one per cpu the pool may run on
+        std::vector<int> decode_cpus;  // Pins decode thread i to decode_cpus[i % size], empty doesn't pin
+        int decode_numa_node{-1};      // Keeps decoding on the cpus of this node, ignored with decode_cpus
+    };
+
+    struct SessionInfo {
+        uint64_t id;
+        std::string stream_key;
+    };
+
+    /**
+     * @brief Called for every accepted publisher before its stream is opened. Returns the handlers of that session
+     */
+    using OnSessionFn = std::function<RtmpServer::Handlers(const SessionInfo&)>;
+    using OnErrorFn = RtmpServer::OnErrorFn;
+
+    RtmpMultiServer(Settings settings);
+    ~RtmpMultiServer();
+
+    void Start();
+    void Stop();
+
+    void SetSessionHandler(OnSessionFn on_session);
+    void SetErrorHandler(OnErrorFn on_error);
+
+    auto session_count() const -> size_t;
+
+    /**
+     * @brief Counters and timings of every running session
+     */
+    auto stats() const -> std::vector<std::pair<SessionInfo, SessionStats>>;
+
+private:
+    struct Session {
+        SessionInfo info;
+        RtmpServer::Handlers handlers;
+        std::unique_ptr<RtmpSession> session;
+        bool done;
+        std::jthread reader;
+    };
+
+    void SubmitError(Error&& error) const;
+    void AcceptWorker(std::stop_token stoken);
+    void ReapSessions();
+
+    Settings settings_;
+    std::unique_ptr<DecodePool> decode_pool_;
+    OnSessionFn on_session_;
+    OnErrorFn on_error_;
+    mutable std::mutex sessions_mutex_;
+    std::condition_variable_any sessions_cv_;
+    std::list<std::unique_ptr<Session>> sessions_;
+    uint64_t next_session_id_;
+    std::unique_ptr<std::jthread> accept_worker_;
+};
+
+}  // namespace oryx
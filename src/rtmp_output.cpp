@@ -0,0 +1,134 @@
+#include "rtmp_output.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/dict.h>
+}
+
+namespace oryx {
+
+namespace {
+
+auto InterruptCallback(void* stoken) -> int {
+    if (!stoken) return 0;
+    return reinterpret_cast<std::stop_token*>(stoken)->stop_requested();
+}
+
+}  // namespace
+
+RtmpOutput::RtmpOutput()
+    : stoken_(),
+      fmt_ctx_(),
+      io_ctx_(),
+      stream_(),
+      src_time_base_num_(),
+      src_time_base_den_(),
+      header_written_() {}
+
+RtmpOutput::~RtmpOutput() { Close(); }
+
+auto RtmpOutput::Open(const std::string& url, const AVCodecContext* codec_ctx, std::stop_token stoken)
+    -> void_expected<av::Error> {
+    auto result = CreateStream();
+    if (!result) {
+        return result;
+    }
+
+    int ret = avcodec_parameters_from_context(stream_->codecpar, codec_ctx);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+
+    src_time_base_num_ = codec_ctx->time_base.num;
+    src_time_base_den_ = codec_ctx->time_base.den;
+    return Connect(url, std::move(stoken));
+}
+
+auto RtmpOutput::Open(const std::string& url, const AVStream* stream, std::stop_token stoken)
+    -> void_expected<av::Error> {
+    auto result = CreateStream();
+    if (!result) {
+        return result;
+    }
+
+    int ret = avcodec_parameters_copy(stream_->codecpar, stream->codecpar);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+    // The input's tag belongs to its container, let flv pick its own
+    stream_->codecpar->codec_tag = 0;
+
+    src_time_base_num_ = stream->time_base.num;
+    src_time_base_den_ = stream->time_base.den;
+    return Connect(url, std::move(stoken));
+}
+
+auto RtmpOutput::CreateStream() -> void_expected<av::Error> {
+    Close();
+
+    AVFormatContext* raw{};
+    int ret = avformat_alloc_output_context2(&raw, nullptr, "flv", nullptr);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+    fmt_ctx_.reset(raw);
+
+    stream_ = avformat_new_stream(raw, nullptr);
+    if (!stream_) {
+        return av::UnexpectedError(AVERROR(ENOMEM));
+    }
+    return kVoidExpected;
+}
+
+auto RtmpOutput::Connect(const std::string& url, std::stop_token stoken) -> void_expected<av::Error> {
+    AVDictionary* options{};
+    av_dict_set(&options, "rtmp_live", "live", 0);
+
+    // A stalled peer would otherwise block the connect, every write and the trailer indefinitely
+    stoken_ = std::move(stoken);
+    fmt_ctx_->interrupt_callback.callback = InterruptCallback;
+    fmt_ctx_->interrupt_callback.opaque = &stoken_;
+
+    AVIOContext* raw{};
+    int ret = avio_open2(&raw, url.c_str(), AVIO_FLAG_WRITE, &fmt_ctx_->interrupt_callback, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+
+    io_ctx_.reset(raw);
+    fmt_ctx_->pb = raw;
+
+    ret = avformat_write_header(fmt_ctx_.get(), nullptr);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+    header_written_ = true;
+    return kVoidExpected;
+}
+
+auto RtmpOutput::Write(AVPacket* packet) -> void_expected<av::Error> {
+    av_packet_rescale_ts(packet, AVRational{src_time_base_num_, src_time_base_den_}, stream_->time_base);
+    packet->stream_index = stream_->index;
+
+    int ret = av_interleaved_write_frame(fmt_ctx_.get(), packet);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+    return kVoidExpected;
+}
+
+void RtmpOutput::Close() {
+    if (header_written_) {
+        av_write_trailer(fmt_ctx_.get());
+        header_written_ = false;
+    }
+
+    fmt_ctx_.reset();
+    io_ctx_.reset();
+    stream_ = nullptr;
+}
+
+}  // namespace oryx
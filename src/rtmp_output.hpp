@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <stop_token>
+
+#include <oryx/expected.hpp>
+
+#include "av_helpers.hpp"
+#include "av_error.hpp"
+
+namespace oryx {
+
+/**
+ * @brief Publishes a single video stream as FLV to an RTMP url
+ */
+class RtmpOutput {
+public:
+    RtmpOutput();
+    ~RtmpOutput();
+
+    /**
+     * @brief Publishes the packets of an encoder. Requesting a stop on stoken aborts a blocked connect or write
+     */
+    auto Open(const std::string& url, const AVCodecContext* codec_ctx, std::stop_token stoken = {})
+        -> void_expected<av::Error>;
+
+    /**
+     * @brief Publishes the packets of an input stream without re-encoding
+     */
+    auto Open(const std::string& url, const AVStream* stream, std::stop_token stoken = {})
+        -> void_expected<av::Error>;
+
+    /**
+     * @brief Writes packet with timestamps in the time base passed to Open. Takes ownership of the packet data
+     */
+    auto Write(AVPacket* packet) -> void_expected<av::Error>;
+    void Close();
+
+    auto is_open() const -> bool { return header_written_; }
+
+private:
+    auto CreateStream() -> void_expected<av::Error>;
+    auto Connect(const std::string& url, std::stop_token stoken) -> void_expected<av::Error>;
+
+    std::stop_token stoken_;  // Polled by the interrupt callback of the io and format context
+    av::UniqueFormatContextPtr fmt_ctx_;
+    av::UniqueIoContextPtr io_ctx_;
+    AVStream* stream_;
+    int src_time_base_num_;
+    int src_time_base_den_;
+    bool header_written_;
+};
+
+}  // namespace oryx
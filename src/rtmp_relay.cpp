@@ -0,0 +1,94 @@
+#include "rtmp_relay.hpp"
+
+extern "C" {
+#include <libavcodec/packet.h>
+}
+
+namespace oryx {
+
+RtmpRelay::Output::Output(std::string url, size_t queue_size)
+    : url(std::move(url)),
+      output(),
+      queue(queue_size),
+      dropping(),
+      writer() {}
+
+RtmpRelay::RtmpRelay(Settings settings)
+    : settings_(std::move(settings)),
+      on_error_(),
+      dropped_packets_(),
+      packet_pool_(av::PacketPool::Create()),
+      outputs_() {}
+
+RtmpRelay::~RtmpRelay() { Close(); }
+
+void RtmpRelay::SetErrorHandler(OnErrorFn on_error) { on_error_ = std::move(on_error); }
+
+void RtmpRelay::SubmitError(Error&& error) const {
+    if (on_error_) {
+        on_error_(std::move(error));
+    }
+}
+
+void RtmpRelay::Open(const RtmpServer::StreamInfo& info) {
+    Close();
+
+    for (const auto& url : settings_.urls) {
+        auto output = std::make_unique<Output>(url, settings_.queue_size);
+        output->writer = std::jthread([this, output = output.get(), stream = info.stream](std::stop_token stoken) {
+            WriteWorker(*output, stream, stoken);
+        });
+        outputs_.push_back(std::move(output));
+    }
+}
+
+void RtmpRelay::Close() {
+    // Stop every writer before joining any, so a stalled output doesn't keep the others connected while we wait
+    for (auto& output : outputs_) {
+        output->writer.request_stop();
+    }
+    outputs_.clear();
+}
+
+void RtmpRelay::Push(const AVPacket* packet) {
+    const bool keyframe = packet->flags & AV_PKT_FLAG_KEY;
+    for (auto& output : outputs_) {
+        // Until the next keyframe whatever we send can't be decoded downstream
+        if (output->dropping && !keyframe) {
+            dropped_packets_.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        auto ref = packet_pool_->Acquire();
+        int ret = av_packet_ref(ref.get(), packet);
+        if (ret < 0) {
+            SubmitError(av::MakeError(ret));
+            continue;
+        }
+
+        output->dropping = !output->queue.TryPush(std::move(ref));
+        if (output->dropping) {
+            dropped_packets_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void RtmpRelay::WriteWorker(Output& output, const AVStream* stream, std::stop_token stoken) {
+    auto result = output.output.Open(output.url, stream, stoken);
+    if (!result) {
+        SubmitError(std::move(result.error()));
+        return;
+    }
+
+    av::UniquePacketPtr packet;
+    while (output.queue.Pop(packet, stoken)) {
+        result = output.output.Write(packet.get());
+        if (!result) {
+            SubmitError(std::move(result.error()));
+            break;
+        }
+    }
+    output.output.Close();
+}
+
+}  // namespace oryx
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+
+#include "av_helpers.hpp"
+#include "av_error.hpp"
+#include "blocking_queue.hpp"
+#include "rtmp_output.hpp"
+#include "rtmp_server.hpp"
+
+namespace oryx {
+
+/**
+ * @brief Republishes one ingested stream to many RTMP urls without re-encoding. Packets are shared by reference
+ * between outputs. Every output connects and writes on its own thread from its own queue, so a slow egress only
+ * drops its own packets.
+ */
+class RtmpRelay {
+public:
+    struct Settings {
+        std::vector<std::string> urls;
+        size_t queue_size;
+    };
+
+    using OnErrorFn = std::function<void(Error)>;
+
+    RtmpRelay(Settings settings);
+    ~RtmpRelay();
+
+    /**
+     * @brief Starts publishing stream to every url. Call from the server's connected handler
+     */
+    void Open(const RtmpServer::StreamInfo& info);
+
+    /**
+     * @brief Queues a reference of packet on every output. Call from the server's packet handler
+     */
+    void Push(const AVPacket* packet);
+
+    /**
+     * @brief Disconnects every output, still queued packets are dropped. Call from the server's disconnected handler
+     * at the latest, the outputs read the stream passed to Open
+     */
+    void Close();
+
+    void SetErrorHandler(OnErrorFn on_error);
+
+    auto dropped_packets() const -> uint64_t { return dropped_packets_.load(std::memory_order_relaxed); }
+
+private:
+    struct Output {
+        Output(std::string url, size_t queue_size);
+
+        std::string url;
+        RtmpOutput output;
+        BlockingQueue<av::UniquePacketPtr> queue;
+        bool dropping;
+        std::jthread writer;
+    };
+
+    void SubmitError(Error&& error) const;
+    void WriteWorker(Output& output, const AVStream* stream, std::stop_token stoken);
+
+    Settings settings_;
+    OnErrorFn on_error_;
+    std::atomic<uint64_t> dropped_packets_;
+    std::shared_ptr<av::PacketPool> packet_pool_;
+    std::vector<std::unique_ptr<Output>> outputs_;
+};
+
+}  // namespace oryx
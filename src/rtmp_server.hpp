@@ -2,76 +2,183 @@
 
 #include <string>
 #include <chrono>
+#include <cstdarg>
 #include <thread>
+#include <memory>
 #include <functional>
 
 #include <oryx/expected.hpp>
-#include <oryx/spsc_queue.hpp>
 
 #include "av_helpers.hpp"
 #include "av_error.hpp"
+#include "metrics.hpp"
+#include "video_frame.hpp"
 
 namespace oryx {
 
+class RtmpSession;
+
 /**
  * @brief Single RTMP Connection server. Only accepts one connection at a time
  */
 class RtmpServer {
 public:
+    /**
+     * @brief What the reader does when the decode queue is full
+     */
+    enum class OverflowPolicy {
+        kBlock,              // Stop reading until the decoder catches up. Pushes back on the publisher via tcp
+        kDropUntilKeyframe,  // Drop incoming packets until the next keyframe fits into the queue
+        kDropOldestGop,      // Decoder discards queued packets up to the next keyframe to make room
+    };
+
+    /**
+     * @brief How the decoder spreads work over its threads
+     */
+    enum class DecoderThreadType {
+        kAuto,   // Frame threading if the codec supports it, slice threading otherwise
+        kFrame,  // Best throughput, adds one frame of latency per extra thread
+        kSlice,  // No added latency, only scales if the publisher encodes multiple slices
+    };
+
+    /**
+     * @brief How a new connection finds its video stream before the first packet is decoded
+     */
+    enum class StartMode {
+        kProbe,           // libavformat's default probing. Buffers seconds of data but fills in every stream parameter
+        kFastProbe,       // Probes only the sequence header and the first keyframe
+        kSequenceHeader,  // No probing, the decoder opens from the FLV sequence header. Resolution and pixel format
+                          // of StreamInfo are unknown
+    };
+
+    /**
+     * @brief Which decoded frames are converted and delivered, for consumers that only need a few frames per second
+     */
+    enum class Decimation {
+        kNone,       // Every frame
+        kKeyframes,  // Only keyframes are decoded at all, everything in between is skipped before the decoder
+        kEveryNth,   // Every frame is decoded but only every decimation_interval-th is converted and delivered
+        kRate,       // Every frame is decoded but at most delivery_rate frames per second of stream time are delivered
+    };
+
+    /**
+     * @brief Filter used when output_size differs from the stream, fastest first
+     */
+    enum class ScaleAlgorithm {
+        kFastBilinear,
+        kBilinear,
+        kBicubic,
+        kArea,  // Best for large downscales like 4k to thumbnails
+        kLanczos,
+    };
+
     struct Settings {
         std::string url;
         std::chrono::milliseconds buffer_time;
         size_t queue_size;
+        OverflowPolicy overflow_policy{OverflowPolicy::kDropUntilKeyframe};
+        PixelFormat output_format{PixelFormat::kBgr24};  // Frames in the decoder's format are passed through
+        ImageSize output_size{};  // Scaled in the same pass as the conversion. 0 keeps the stream's, one 0 keeps aspect
+        ScaleAlgorithm scale_algorithm{ScaleAlgorithm::kBilinear};
+        bool skip_loop_filter{};  // Skip h264 deblocking. Much cheaper decoding, visible blocking at low bitrates
+        int lowres{};             // Decode at 1/2^lowres size, only codecs like mjpeg support it. h264 ignores it
+        bool decode{true};  // False only forwards packets to the packet handler, no decoder is opened
+        int decoder_threads{1};  // 0 lets libavcodec use one thread per core
+        DecoderThreadType decoder_thread_type{DecoderThreadType::kAuto};
+        bool low_delay{};  // Output frames as soon as possible. Disables frame threading
+        // More than one converts in parallel slices on a stage pipelined with decoding. Sessions on a shared decode
+        // pool convert in slices without the extra stage
+        size_t convert_threads{1};
+        StartMode start_mode{StartMode::kProbe};
+        Decimation decimation{Decimation::kNone};
+        int decimation_interval{1};
+        double delivery_rate{1.0};
     };
 
     struct StreamInfo {
         std::string codec;
         std::string stream_fmt;
+        std::string stream_key;
         ImageSize resolution;
         int stream_index;
+        const AVStream* stream;  // Codec parameters and time base of the packets. Valid until disconnected
     };
 
     using OnImageFn = std::function<void(Image)>;
+    using OnFrameFn = std::function<void(VideoFrame)>;
+    using OnPacketFn = std::function<void(const AVPacket*)>;
     using OnErrorFn = std::function<void(Error)>;
     using OnConnectedFn = std::function<void(StreamInfo)>;
     using OnDisconnectedFn = std::function<void()>;
 
+    struct Handlers {
+        OnImageFn on_image;
+        OnFrameFn on_frame;
+        OnPacketFn on_packet;
+        OnErrorFn on_error;
+        OnConnectedFn on_connect;
+        OnDisconnectedFn on_disconnect;
+    };
+
     RtmpServer(Settings settings);
     ~RtmpServer();
 
     void Start();
     void Stop();
 
+    /**
+     * @brief Receives a deep copy of every decoded image. Prefer SetFrameHandler which does not copy
+     */
     void SetImageHandler(OnImageFn on_image);
+
+    /**
+     * @brief Receives every decoded image as pooled frame. The buffer returns to the pool once the handler and every
+     * copy of the frame released it
+     */
+    void SetFrameHandler(OnFrameFn on_frame);
+
+    /**
+     * @brief Receives every compressed video packet on the reader thread before it is decoded. Use av_packet_ref to
+     * keep it beyond the call
+     */
+    void SetPacketHandler(OnPacketFn on_packet);
     void SetErrorHandler(OnErrorFn on_error);
     void SetConnectedHandler(OnConnectedFn on_connect);
     void SetDisconnectedHandler(OnDisconnectedFn on_disconnect);
 
+    /**
+     * @brief Total number of packets dropped by the overflow policy
+     */
+    auto dropped_packets() const -> uint64_t;
+
+    /**
+     * @brief Total number of frames the decoder produced
+     */
+    auto decoded_frames() const -> uint64_t;
+
+    /**
+     * @brief Counters and timings accumulated over every connection since construction. Cheap enough to poll, never
+     * blocks the pipeline
+     */
+    auto stats() const -> SessionStats;
+
 private:
     void SubmitError(Error&& error) const;
-    auto Decode(AVPacket* packet) -> void_expected<av::Error>;
-    auto OpenCodecContext() -> void_expected<av::Error>;
-
     void ReadWorker(std::stop_token stoken);
-    void DecodeWorker(std::stop_token stoken);
 
     Settings settings_;
-    av::UniqueFramePtr frame_;
-    av::UniqueCodecContextPtr dec_ctx_;
-    av::UniqueSwsContextPtr sws_ctx_;
-    av::UniqueFormatContextPtr fmt_ctx_;
-    folly::ProducerConsumerQueue<av::UniquePacketPtr> queue_;
-    OnImageFn on_image_;
-    OnErrorFn on_error_;
-    OnConnectedFn on_connect_;
-    OnDisconnectedFn on_disconnect_;
+    Handlers handlers_;
+    std::unique_ptr<RtmpSession> session_;
     std::unique_ptr<std::jthread> read_worker_;
-    std::unique_ptr<std::jthread> decode_worker_;
-    int video_stream_index_;
-
-    uint8_t* buffer_data[4];
-    int buffer_ls[4];
-    int buffer_data_size;
 };
 
-}  // namespace oryx
\ No newline at end of file
+using AvLogCallbackFn = void (*)(void* avcl, int level, const char* fmt, va_list args);
+
+/**
+ * @brief Receives every libav log message. Accepting a publisher installs its own av_log callback to learn the stream
+ * key and libav can't hand out the callback it replaces, so install yours here instead of with av_log_set_callback.
+ * Defaults to av_log_default_callback
+ */
+void SetAvLogCallback(AvLogCallbackFn callback);
+
+}  // namespace oryx
@@ -0,0 +1,725 @@
+#include "rtmp_session.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <algorithm>
+#include <cstdarg>
+#include <cstring>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/log.h>
+}
+
+#include <oryx/enchantum.hpp>
+
+namespace oryx {
+
+namespace {
+
+// libavformat's rtmp listener does not expose the stream name a client publishes to. It only logs it when it does
+// not match the last segment of the listen url, so we pick it up from there while accepting. This depends on the
+// exact format string read_connect in libavformat/rtmpproto.c logs with, checked against FFmpeg 7.1. Should it
+// change, sessions silently fall back to the last segment of the listen url as their stream key.
+constexpr char kUnexpectedStreamLog[] = "Unexpected stream %s, expecting %s\n";
+
+// Set only while this thread is inside avformat_open_input, the rtmp handshake logs synchronously on it
+thread_local std::string* accepted_stream_key{};
+
+std::atomic<AvLogCallbackFn> forward_log_callback{};
+
+// Only the rtmp protocol's own URLContext logs the line we are after, e.g. not a muxer with a similar message
+auto IsRtmpLogContext(void* avcl) -> bool {
+    if (!avcl) {
+        return false;
+    }
+    auto av_class = *static_cast<const AVClass**>(avcl);
+    if (!av_class || !av_class->item_name || std::strcmp(av_class->class_name, "URLContext") != 0) {
+        return false;
+    }
+    return std::strncmp(av_class->item_name(avcl), "rtmp", 4) == 0;
+}
+
+void CaptureStreamKeyLog(void* avcl, int level, const char* fmt, va_list args) {
+    if (accepted_stream_key && fmt && std::strcmp(fmt, kUnexpectedStreamLog) == 0 && IsRtmpLogContext(avcl)) {
+        va_list copy;
+        va_copy(copy, args);
+        *accepted_stream_key = va_arg(copy, const char*);
+        va_end(copy);
+    }
+
+    if (auto callback = forward_log_callback.load(std::memory_order_relaxed)) {
+        callback(avcl, level, fmt, args);
+    } else {
+        av_log_default_callback(avcl, level, fmt, args);
+    }
+}
+
+auto DefaultStreamKey(const std::string& url) -> std::string {
+    auto pos = url.find_last_of('/');
+    return pos == std::string::npos ? url : url.substr(pos + 1);
+}
+
+using Clock = std::chrono::steady_clock;
+
+// Fast start reads the sequence header and the first keyframe, a packet is always read whole. Zero would pick the
+// 5 second default of libavformat
+constexpr int64_t kFastStartProbeSize = 4096;
+constexpr int64_t kFastStartAnalyzeDuration = AV_TIME_BASE / 10;
+
+// The time a packet was read travels with it into the decoded frame through opaque, see AV_CODEC_FLAG_COPY_OPAQUE
+void StampReadTime(AVPacket* packet) {
+    packet->opaque = reinterpret_cast<void*>(static_cast<intptr_t>(Clock::now().time_since_epoch().count()));
+}
+
+auto ReadTime(const AVFrame* frame) -> std::optional<Clock::time_point> {
+    auto ticks = static_cast<Clock::rep>(reinterpret_cast<intptr_t>(frame->opaque));
+    if (ticks == 0) {
+        return std::nullopt;
+    }
+    return Clock::time_point(Clock::duration(ticks));
+}
+
+// A decoder opened for dec can take over a new stream described by par without reopening
+auto CanReuseDecoder(const AVCodecContext* dec, const AVCodecParameters* par) -> bool {
+    if (!dec || dec->codec_id != par->codec_id || dec->profile != par->profile) {
+        return false;
+    }
+    // Starting from the sequence header leaves these unknown, identical extradata already means identical sps
+    if (par->width != 0 && (dec->width != par->width || dec->height != par->height)) {
+        return false;
+    }
+    if (par->format != AV_PIX_FMT_NONE && dec->pix_fmt != par->format) {
+        return false;
+    }
+    // Parameter sets and the nal length size come from extradata and are only parsed when opening
+    return dec->extradata_size == par->extradata_size &&
+           (par->extradata_size == 0 || std::memcmp(dec->extradata, par->extradata, par->extradata_size) == 0);
+}
+
+auto ToSwsFlags(RtmpServer::ScaleAlgorithm algorithm) -> int {
+    switch (algorithm) {
+        case RtmpServer::ScaleAlgorithm::kFastBilinear:
+            return SWS_FAST_BILINEAR;
+        case RtmpServer::ScaleAlgorithm::kBilinear:
+            return SWS_BILINEAR;
+        case RtmpServer::ScaleAlgorithm::kBicubic:
+            return SWS_BICUBIC;
+        case RtmpServer::ScaleAlgorithm::kArea:
+            return SWS_AREA;
+        case RtmpServer::ScaleAlgorithm::kLanczos:
+            return SWS_LANCZOS;
+    }
+    return SWS_BILINEAR;
+}
+
+// requested with a zero dimension follows the aspect ratio of source, rounded to even for chroma subsampling
+auto OutputSize(ImageSize source, ImageSize requested) -> ImageSize {
+    if (requested.width <= 0 && requested.height <= 0) {
+        return source;
+    }
+    if (requested.width <= 0) {
+        const int width = static_cast<int>(int64_t{source.width} * requested.height / std::max(source.height, 1));
+        return ImageSize((width + 1) & ~1, requested.height);
+    }
+    if (requested.height <= 0) {
+        const int height = static_cast<int>(int64_t{source.height} * requested.width / std::max(source.width, 1));
+        return ImageSize(requested.width, (height + 1) & ~1);
+    }
+    return requested;
+}
+
+auto InterruptCallback(void* stoken) -> int {
+    if (!stoken) return 0;
+    return reinterpret_cast<std::stop_token*>(stoken)->stop_requested();
+}
+
+}  // namespace
+
+void SetAvLogCallback(AvLogCallbackFn callback) { forward_log_callback.store(callback, std::memory_order_relaxed); }
+
+auto RtmpSession::Accept(const RtmpServer::Settings& settings, std::stop_token& stoken)
+    -> std::expected<Connection, av::Error> {
+    static std::once_flag install_log_callback;
+    std::call_once(install_log_callback, [] { av_log_set_callback(CaptureStreamKeyLog); });
+
+    AVDictionary* rtmp_options = nullptr;
+    av_dict_set(&rtmp_options, "listen", "1", 0);
+    av_dict_set(&rtmp_options, "rtmp_buffer", std::to_string(settings.buffer_time.count()).c_str(), 0);
+
+    AVFormatContext* fmt_ctx = avformat_alloc_context();
+    fmt_ctx->interrupt_callback.callback = InterruptCallback;
+    fmt_ctx->interrupt_callback.opaque = &stoken;
+
+    Connection connection;
+    connection.stream_key = DefaultStreamKey(settings.url);
+
+    accepted_stream_key = &connection.stream_key;
+    int ret = avformat_open_input(&fmt_ctx, settings.url.c_str(), nullptr, &rtmp_options);
+    accepted_stream_key = nullptr;
+    av_dict_free(&rtmp_options);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+
+    connection.fmt_ctx = av::UniqueFormatContextPtr(fmt_ctx);
+    connection.connected_at = Clock::now();
+    return connection;
+}
+
+RtmpSession::RtmpSession(const RtmpServer::Settings& settings,
+                         const RtmpServer::Handlers& handlers,
+                         DecodePool* decode_pool)
+    : settings_(settings),
+      handlers_(handlers),
+      stream_key_(),
+      frame_(av::MakeUniqueFrame()),
+      dec_ctx_(),
+      converter_(std::make_unique<FrameConverter>(settings.convert_threads)),
+      fmt_ctx_(),
+      frame_pool_(VideoFramePool::Create()),
+      packet_pool_(av::PacketPool::Create(std::max(settings_.queue_size + 2, av::PacketPool::kDefaultMaxCached))),
+      queue_(settings_.queue_size),
+      strand_(),
+      decode_worker_(),
+      decode_stoken_(),
+      convert_queue_(kConvertQueueSize),
+      convert_worker_(),
+      video_stream_index_(),
+      metrics_(),
+      connected_at_(),
+      awaiting_first_image_(),
+      flushed_(),
+      drop_gop_requested_(),
+      decimation_count_(),
+      next_delivery_pts_(),
+      delivery_interval_(),
+      dropping_(),
+      discarding_() {
+    if (decode_pool) {
+        strand_.emplace(*decode_pool, [this] { Drain(); }, [this] { return queue_.Size() > 0; });
+        strand_->Close();
+    }
+}
+
+RtmpSession::~RtmpSession() { StopDecoding(); }
+
+void RtmpSession::SubmitError(Error&& error) const {
+    if (handlers_.on_error) {
+        handlers_.on_error(std::move(error));
+    }
+}
+
+void RtmpSession::Run(Connection connection, std::stop_token stoken) {
+    fmt_ctx_ = std::move(connection.fmt_ctx);
+    fmt_ctx_->interrupt_callback.opaque = &stoken;
+    stream_key_ = std::move(connection.stream_key);
+    connected_at_ = connection.connected_at;
+    awaiting_first_image_ = true;
+
+    auto result = Serve(stoken);
+    if (!result) {
+        SubmitError(std::move(result.error()));
+    }
+    Reset();
+}
+
+auto RtmpSession::Serve(std::stop_token& stoken) -> void_expected<av::Error> {
+    auto fmt_ctx = fmt_ctx_.get();
+    av::UniquePacketPtr first_packet;
+    int ret{};
+    if (settings_.start_mode == RtmpServer::StartMode::kSequenceHeader) {
+        auto result = ReadFirstVideoPacket(first_packet);
+        if (!result) {
+            return result;
+        }
+        ret = first_packet->stream_index;
+    } else {
+        if (settings_.start_mode == RtmpServer::StartMode::kFastProbe) {
+            fmt_ctx->probesize = kFastStartProbeSize;
+            fmt_ctx->max_analyze_duration = kFastStartAnalyzeDuration;
+            fmt_ctx->fps_probe_size = 0;
+        }
+        ret = avformat_find_stream_info(fmt_ctx, NULL);
+        if (ret < 0) {
+            return av::UnexpectedError(ret);
+        }
+
+        ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        if (ret < 0) {
+            return av::UnexpectedError(ret);
+        }
+    }
+
+    video_stream_index_ = ret;
+    AVStream* stream = fmt_ctx->streams[video_stream_index_];
+    if (settings_.decode) {
+        auto result = OpenCodecContext();
+        if (!result) {
+            return result;
+        }
+    }
+
+    if (handlers_.on_connect) {
+        auto codecpar = stream->codecpar;
+        RtmpServer::StreamInfo info;
+        info.codec = enchantum::to_string(codecpar->codec_id);
+        info.stream_fmt = enchantum::to_string(static_cast<AVPixelFormat>(codecpar->format));
+        info.resolution = ImageSize(codecpar->width, codecpar->height);
+        info.stream_index = video_stream_index_;
+        info.stream_key = stream_key_;
+        info.stream = stream;
+        handlers_.on_connect(info);
+    }
+
+    if (settings_.decode) {
+        StartDecoding();
+    }
+
+    av_dump_format(fmt_ctx, 0, settings_.url.c_str(), 0);
+
+    if (first_packet) {
+        Process(std::move(first_packet), stoken);
+    }
+
+    while (ret >= 0) {
+        auto packet = packet_pool_->Acquire();
+        ret = av_read_frame(fmt_ctx, packet.get());
+        if (ret < 0) {
+            break;
+        }
+        Process(std::move(packet), stoken);
+    }
+
+    if (ret == AVERROR_EOF && settings_.decode) {
+        Flush(stoken);
+    }
+
+    if (handlers_.on_disconnect) {
+        handlers_.on_disconnect();
+    }
+    return kVoidExpected;
+}
+
+auto RtmpSession::ReadFirstVideoPacket(av::UniquePacketPtr& packet) -> void_expected<av::Error> {
+    // Without probing flv creates its streams as their first tags arrive. The sequence header of the video stream
+    // fills in its extradata before the first video packet is returned, which is all the decoder needs to open
+    while (true) {
+        packet = packet_pool_->Acquire();
+        int ret = av_read_frame(fmt_ctx_.get(), packet.get());
+        if (ret < 0) {
+            return av::UnexpectedError(ret);
+        }
+        if (fmt_ctx_->streams[packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            return kVoidExpected;
+        }
+    }
+}
+
+void RtmpSession::Process(av::UniquePacketPtr packet, std::stop_token& stoken) {
+    // We only want our video. Ignore everything else
+    if (packet->stream_index != video_stream_index_) {
+        return;
+    }
+
+    StampReadTime(packet.get());
+    metrics_.packets_read.Add();
+    metrics_.bytes_read.Add(packet->size);
+
+    if (handlers_.on_packet) {
+        const auto start = Clock::now();
+        handlers_.on_packet(packet.get());
+        metrics_.handler_time.Record(Clock::now() - start);
+    }
+
+    if (!settings_.decode) {
+        return;
+    }
+
+    // Nothing but keyframes reaches the decoder, they decode without references
+    if (settings_.decimation == RtmpServer::Decimation::kKeyframes && !(packet->flags & AV_PKT_FLAG_KEY)) {
+        metrics_.decimated_frames.Add();
+        return;
+    }
+
+    Enqueue(std::move(packet), stoken);
+    metrics_.queue_depth.Set(queue_.Size());
+    if (strand_) {
+        strand_->Notify();
+    }
+}
+
+void RtmpSession::Reset() {
+    StopDecoding();
+    fmt_ctx_.reset();
+    // The decoder, converter and frame pool stay around for a publisher that reconnects with the same stream
+    queue_.Clear();
+}
+
+void RtmpSession::StartDecoding() {
+    dropping_ = false;
+    discarding_ = false;
+    drop_gop_requested_.store(false);
+
+    decimation_count_ = 0;
+    next_delivery_pts_ = AV_NOPTS_VALUE;
+    const auto time_base = fmt_ctx_->streams[video_stream_index_]->time_base;
+    const double rate = std::max(settings_.delivery_rate, 0.001);
+    delivery_interval_ = static_cast<int64_t>(time_base.den / (time_base.num * rate));
+
+    // Waiting for the convert stage would hold up every session sharing a pool thread, sessions on the pool convert
+    // in place on their slice threads instead
+    if (settings_.convert_threads > 1 && !strand_) {
+        convert_worker_ = std::make_unique<std::jthread>([this](std::stop_token stoken) { ConvertWorker(stoken); });
+    }
+
+    if (strand_) {
+        strand_->Open();
+    } else {
+        decode_worker_ = std::make_unique<std::jthread>([this](std::stop_token stoken) { DecodeWorker(stoken); });
+    }
+}
+
+void RtmpSession::StopDecoding() {
+    if (strand_) {
+        strand_->Close();
+    }
+    decode_worker_.reset();
+
+    // Only after the decoder stopped, it may still be waiting for room in the convert queue
+    convert_worker_.reset();
+    convert_queue_.Clear();
+}
+
+void RtmpSession::Flush(std::stop_token& stoken) {
+    // An empty packet drains the decoder. Waits until the frames it held back reached the handlers
+    flushed_.store(false);
+    if (!queue_.Push(packet_pool_->Acquire(), stoken)) {
+        return;
+    }
+    if (strand_) {
+        strand_->Notify();
+    }
+
+    std::stop_callback on_stop(stoken, [this] { SignalFlushed(); });
+    flushed_.wait(false);
+}
+
+void RtmpSession::SignalFlushed() {
+    flushed_.store(true);
+    flushed_.notify_all();
+}
+
+void RtmpSession::CountDropped() { metrics_.dropped_packets.Add(); }
+
+void RtmpSession::Enqueue(av::UniquePacketPtr packet, std::stop_token& stoken) {
+    switch (settings_.overflow_policy) {
+        case RtmpServer::OverflowPolicy::kBlock:
+            queue_.Push(std::move(packet), stoken);
+            break;
+        case RtmpServer::OverflowPolicy::kDropUntilKeyframe:
+            // Once we dropped something the decoder can't use anything until the next keyframe
+            if (dropping_ && !(packet->flags & AV_PKT_FLAG_KEY)) {
+                CountDropped();
+                break;
+            }
+            dropping_ = !queue_.TryPush(std::move(packet));
+            if (dropping_) {
+                CountDropped();
+            }
+            break;
+        case RtmpServer::OverflowPolicy::kDropOldestGop:
+            if (queue_.TryPush(std::move(packet))) {
+                break;
+            }
+            // Let the decoder throw away the oldest gop and wait for it to make room
+            drop_gop_requested_.store(true);
+            if (strand_) {
+                strand_->Notify();
+            }
+            queue_.Push(std::move(packet), stoken);
+            break;
+    }
+}
+
+auto RtmpSession::ShouldDiscard(const AVPacket* packet) -> bool {
+    if (drop_gop_requested_.exchange(false)) {
+        // Always discard the head, it is either part of or the start of the oldest gop
+        discarding_ = true;
+        CountDropped();
+        return true;
+    }
+
+    if (discarding_) {
+        if (packet->flags & AV_PKT_FLAG_KEY) {
+            discarding_ = false;
+            return false;
+        }
+        CountDropped();
+        return true;
+    }
+    return false;
+}
+
+void RtmpSession::DecodePacket(AVPacket* packet) {
+    if (!packet) {
+        return;
+    }
+
+    const bool flush = !packet->data && packet->side_data_elems == 0;
+    if (!flush && ShouldDiscard(packet)) {
+        return;
+    }
+
+    auto result = Decode(packet);
+    if (!result) {
+        SubmitError(std::move(result.error()));
+    }
+
+    if (flush) {
+        // The convert stage signals once it got past the frames in front of the marker
+        if (!convert_worker_ || !convert_queue_.Push(VideoFrame(), decode_stoken_)) {
+            SignalFlushed();
+        }
+    }
+}
+
+auto RtmpSession::Decode(AVPacket* packet) -> void_expected<av::Error> {
+    auto dec = dec_ctx_.get();
+
+    // Decode time leaves out delivering the frames
+    auto start = Clock::now();
+    Clock::duration decode_time{};
+    int ret = avcodec_send_packet(dec, packet);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+
+    // get all the available frames from the decoder
+    auto frame = frame_.get();
+    while (ret >= 0) {
+        ret = avcodec_receive_frame(dec, frame);
+        decode_time += Clock::now() - start;
+        if (ret < 0) {
+            metrics_.decode_time.Record(decode_time);
+            // those two return values are special and mean there is no output
+            // frame available, but there were no errors during decoding
+            if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+                return kVoidExpected;
+            }
+            return av::UnexpectedError(ret);
+        }
+
+        metrics_.decoded_frames.Add();
+        auto result = Deliver(frame);
+        start = Clock::now();
+        av_frame_unref(frame);
+        if (!result) {
+            return result;
+        }
+    }
+
+    return kVoidExpected;
+}
+
+auto RtmpSession::ShouldDeliver(const AVFrame* frame) -> bool {
+    switch (settings_.decimation) {
+        case RtmpServer::Decimation::kNone:
+        case RtmpServer::Decimation::kKeyframes:
+            return true;
+        case RtmpServer::Decimation::kEveryNth:
+            return decimation_count_++ % std::max(settings_.decimation_interval, 1) == 0;
+        case RtmpServer::Decimation::kRate: {
+            const auto pts = frame->best_effort_timestamp;
+            if (pts == AV_NOPTS_VALUE) {
+                return true;
+            }
+            if (next_delivery_pts_ != AV_NOPTS_VALUE && pts < next_delivery_pts_) {
+                return false;
+            }
+            // Step along the schedule so jittery timestamps don't lower the rate, start over after gaps and seeks
+            const bool on_schedule =
+                next_delivery_pts_ != AV_NOPTS_VALUE && pts - next_delivery_pts_ < delivery_interval_;
+            next_delivery_pts_ = (on_schedule ? next_delivery_pts_ : pts) + delivery_interval_;
+            return true;
+        }
+    }
+    return true;
+}
+
+auto RtmpSession::Deliver(const AVFrame* frame) -> void_expected<av::Error> {
+    if (!handlers_.on_image && !handlers_.on_frame) {
+        return kVoidExpected;
+    }
+
+    // Decimated frames are never converted, which is where most of the per frame cost goes besides decoding
+    if (!ShouldDeliver(frame)) {
+        metrics_.decimated_frames.Add();
+        return kVoidExpected;
+    }
+
+    if (!convert_worker_) {
+        return Convert(frame);
+    }
+
+    // Hand a reference to the convert stage so the next packet decodes while this frame converts
+    auto decoded = frame_pool_->Wrap(frame);
+    if (!decoded) {
+        return std::unexpected(std::move(decoded.error()));
+    }
+    // Only fails once decoding stops, the frame is dropped with everything else still queued
+    convert_queue_.Push(std::move(*decoded), decode_stoken_);
+    return kVoidExpected;
+}
+
+auto RtmpSession::Convert(const AVFrame* frame) -> void_expected<av::Error> {
+    auto output_fmt = av::ToAVPixelFormat(settings_.output_format);
+    if (output_fmt == AV_PIX_FMT_NONE) {
+        output_fmt = frame->format;
+    }
+
+    const ImageSize size(frame->width, frame->height);
+    const auto output_size = OutputSize(size, settings_.output_size);
+    const bool passthrough = output_fmt == frame->format && output_size == size;
+    auto output = passthrough ? frame_pool_->Wrap(frame) : frame_pool_->Acquire(output_size, output_fmt);
+    if (!output) {
+        return std::unexpected(std::move(output.error()));
+    }
+
+    auto out = output->av_frame();
+    if (!passthrough) {
+        const auto start = Clock::now();
+        auto result = converter_->Convert(frame, out, ToSwsFlags(settings_.scale_algorithm));
+        metrics_.convert_time.Record(Clock::now() - start);
+        if (!result) {
+            return result;
+        }
+    }
+    out->pts = frame->best_effort_timestamp;
+
+    const auto start = Clock::now();
+    if (auto read_time = ReadTime(frame)) {
+        metrics_.latency.Record(start - *read_time);
+    }
+    if (awaiting_first_image_) {
+        awaiting_first_image_ = false;
+        metrics_.first_image.Record(start - connected_at_);
+    }
+    if (handlers_.on_image) {
+        handlers_.on_image(output->image().clone());
+    }
+    if (handlers_.on_frame) {
+        handlers_.on_frame(std::move(*output));
+    }
+    metrics_.handler_time.Record(Clock::now() - start);
+    return kVoidExpected;
+}
+
+auto RtmpSession::OpenCodecContext() -> void_expected<av::Error> {
+    AVStream* stream = fmt_ctx_->streams[video_stream_index_];
+
+    if (CanReuseDecoder(dec_ctx_.get(), stream->codecpar)) {
+        // Drops whatever the last session left behind, including the end of stream state after a flush
+        avcodec_flush_buffers(dec_ctx_.get());
+        return kVoidExpected;
+    }
+    dec_ctx_.reset();
+
+    const AVCodec* codec{};
+    if (stream->codecpar->codec_id == AV_CODEC_ID_H264) {
+        // Try nvidia hwaccel first
+        // codec = avcodec_find_decoder_by_name("h264_cuvid");
+    }
+
+    if (!codec) {
+        codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    }
+
+    if (!codec) {
+        return UnexpectedError(
+            std::format("Failed to find suitable codec for id={}", static_cast<int>(stream->codecpar->codec_id)));
+    }
+
+    /* Allocate a codec context for the decoder */
+    dec_ctx_ = av::MakeUniqueCodecContext(codec);
+
+    /* Copy codec parameters from input stream to output codec context */
+    int ret = avcodec_parameters_to_context(dec_ctx_.get(), stream->codecpar);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+
+    dec_ctx_->thread_count = settings_.decoder_threads;
+    switch (settings_.decoder_thread_type) {
+        case RtmpServer::DecoderThreadType::kAuto:
+            dec_ctx_->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+            break;
+        case RtmpServer::DecoderThreadType::kFrame:
+            dec_ctx_->thread_type = FF_THREAD_FRAME;
+            break;
+        case RtmpServer::DecoderThreadType::kSlice:
+            dec_ctx_->thread_type = FF_THREAD_SLICE;
+            break;
+    }
+
+    if (settings_.low_delay) {
+        dec_ctx_->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    }
+
+    // Carries the read time of packets into their frames for the latency metric
+    dec_ctx_->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+
+    if (settings_.decimation == RtmpServer::Decimation::kKeyframes) {
+        dec_ctx_->skip_frame = AVDISCARD_NONKEY;
+    }
+    if (settings_.skip_loop_filter) {
+        dec_ctx_->skip_loop_filter = AVDISCARD_ALL;
+    }
+    dec_ctx_->lowres = std::min(settings_.lowres, static_cast<int>(codec->max_lowres));
+
+    /* Init the decoder */
+    ret = avcodec_open2(dec_ctx_.get(), codec, NULL);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+    return kVoidExpected;
+}
+
+void RtmpSession::Drain() {
+    av::UniquePacketPtr packet;
+    for (size_t i = 0; i < kDrainBatchSize && queue_.TryPop(packet); i++) {
+        DecodePacket(packet.get());
+    }
+}
+
+void RtmpSession::DecodeWorker(std::stop_token stoken) {
+    decode_stoken_ = stoken;
+    av::UniquePacketPtr packet;
+    while (queue_.Pop(packet, stoken)) {
+        DecodePacket(packet.get());
+    }
+}
+
+void RtmpSession::ConvertWorker(std::stop_token stoken) {
+    VideoFrame frame;
+    while (convert_queue_.Pop(frame, stoken)) {
+        // An empty frame marks the end of a flush
+        if (!frame) {
+            SignalFlushed();
+            continue;
+        }
+        auto result = Convert(frame.av_frame());
+        frame = VideoFrame();
+        if (!result) {
+            SubmitError(std::move(result.error()));
+        }
+    }
+}
+
+}  // namespace oryx
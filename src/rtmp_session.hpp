@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <expected>
+#include <optional>
+#include <thread>
+
+#include <oryx/expected.hpp>
+
+#include "av_helpers.hpp"
+#include "av_error.hpp"
+#include "blocking_queue.hpp"
+#include "decode_pool.hpp"
+#include "frame_converter.hpp"
+#include "metrics.hpp"
+#include "video_frame.hpp"
+#include "rtmp_server.hpp"
+
+namespace oryx {
+
+/**
+ * @brief Reads, decodes and converts the stream of a single accepted RTMP connection
+ */
+class RtmpSession {
+public:
+    struct Connection {
+        av::UniqueFormatContextPtr fmt_ctx;
+        std::string stream_key;
+        std::chrono::steady_clock::time_point connected_at;  // Start of the connect to first image time
+    };
+
+    /**
+     * @brief Blocks until a publisher connected to settings.url or stop was requested on stoken
+     */
+    static auto Accept(const RtmpServer::Settings& settings, std::stop_token& stoken)
+        -> std::expected<Connection, av::Error>;
+
+    /**
+     * @param decode_pool Pool to decode on. Nullptr decodes on a dedicated thread
+     */
+    RtmpSession(const RtmpServer::Settings& settings, const RtmpServer::Handlers& handlers, DecodePool* decode_pool);
+    ~RtmpSession();
+
+    /**
+     * @brief Serves connection until the publisher disconnects or stop was requested on stoken. At the end of a finite
+     * input like a file the frames still in the decoder are delivered before returning
+     */
+    void Run(Connection connection, std::stop_token stoken);
+
+    auto dropped_packets() const -> uint64_t { return metrics_.dropped_packets.value(); }
+    auto decoded_frames() const -> uint64_t { return metrics_.decoded_frames.value(); }
+    auto stats() const -> SessionStats { return metrics_.Snapshot(); }
+
+private:
+    static constexpr size_t kDrainBatchSize = 8;
+    static constexpr size_t kConvertQueueSize = 2;
+
+    void SubmitError(Error&& error) const;
+    auto Serve(std::stop_token& stoken) -> void_expected<av::Error>;
+    auto ReadFirstVideoPacket(av::UniquePacketPtr& packet) -> void_expected<av::Error>;
+    void Process(av::UniquePacketPtr packet, std::stop_token& stoken);
+    void Reset();
+    void StartDecoding();
+    void StopDecoding();
+    void Flush(std::stop_token& stoken);
+    void SignalFlushed();
+    void Enqueue(av::UniquePacketPtr packet, std::stop_token& stoken);
+    auto ShouldDiscard(const AVPacket* packet) -> bool;
+    void CountDropped();
+    void DecodePacket(AVPacket* packet);
+    auto Decode(AVPacket* packet) -> void_expected<av::Error>;
+    auto ShouldDeliver(const AVFrame* frame) -> bool;
+    auto Deliver(const AVFrame* frame) -> void_expected<av::Error>;
+    auto Convert(const AVFrame* frame) -> void_expected<av::Error>;
+    auto OpenCodecContext() -> void_expected<av::Error>;
+
+    void Drain();
+    void DecodeWorker(std::stop_token stoken);
+    void ConvertWorker(std::stop_token stoken);
+
+    const RtmpServer::Settings& settings_;
+    const RtmpServer::Handlers& handlers_;
+    std::string stream_key_;
+    av::UniqueFramePtr frame_;
+    av::UniqueCodecContextPtr dec_ctx_;
+    std::unique_ptr<FrameConverter> converter_;
+    av::UniqueFormatContextPtr fmt_ctx_;
+    std::shared_ptr<VideoFramePool> frame_pool_;
+    std::shared_ptr<av::PacketPool> packet_pool_;
+    BlockingQueue<av::UniquePacketPtr> queue_;
+    std::optional<DecodePool::Strand> strand_;
+    std::unique_ptr<std::jthread> decode_worker_;
+    std::stop_token decode_stoken_;  // Of decode_worker_, interrupts waiting for room in the convert queue
+    BlockingQueue<VideoFrame> convert_queue_;
+    std::unique_ptr<std::jthread> convert_worker_;
+    int video_stream_index_;
+    SessionMetrics metrics_;
+    std::chrono::steady_clock::time_point connected_at_;
+    bool awaiting_first_image_;  // Only touched by whichever stage delivers frames
+    std::atomic_bool flushed_;  // Set once a flush at the end of the input reached the handlers
+    std::atomic_bool drop_gop_requested_;
+    uint64_t decimation_count_;   // Frames seen by the decoder side decimation
+    int64_t next_delivery_pts_;   // kRate decimation, in stream time base
+    int64_t delivery_interval_;   // kRate decimation, in stream time base
+    bool dropping_;    // Reader side drop until keyframe state
+    bool discarding_;  // Decoder side drop oldest gop state
+};
+
+}  // namespace oryx
@@ -0,0 +1,285 @@
+#include "segment_recorder.hpp"
+
+#include <cctype>
+#include <cerrno>
+#include <ctime>
+#include <format>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/packet.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+}
+
+namespace oryx {
+
+namespace {
+
+auto WriteToFile(void* opaque, const uint8_t* data, int size) -> int {
+    const int fd = *static_cast<int*>(opaque);
+    int written = 0;
+    while (written < size) {
+        auto ret = ::write(fd, data + written, size - written);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return AVERROR(errno);
+        }
+        written += static_cast<int>(ret);
+    }
+    return written;
+}
+
+// Stream keys may contain anything a publisher sends, keep file names tame
+auto SanitizeFileName(const std::string& name) -> std::string {
+    std::string sanitized = name.empty() ? "stream" : name;
+    auto unsafe = [](char c) { return !std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_'; };
+    std::ranges::replace_if(sanitized, unsafe, '_');
+    return sanitized;
+}
+
+auto Timestamp() -> std::string {
+    const auto now = std::time(nullptr);
+    std::tm local{};
+    localtime_r(&now, &local);
+    char buffer[32];
+    std::strftime(buffer, sizeof(buffer), "%Y%m%d-%H%M%S", &local);
+    return buffer;
+}
+
+}  // namespace
+
+SegmentRecorder::SegmentRecorder(Settings settings)
+    : settings_(std::move(settings)),
+      on_error_(),
+      on_segment_(),
+      dropped_packets_(),
+      packet_pool_(av::PacketPool::Create(std::max(settings_.queue_size + 2, av::PacketPool::kDefaultMaxCached))),
+      queue_(settings_.queue_size),
+      dropping_(),
+      stream_(),
+      stream_key_(),
+      segment_index_(),
+      segment_path_(),
+      segment_start_pts_(),
+      segment_ctx_(),
+      segment_io_(),
+      segment_fd_(-1),
+      header_written_(),
+      writer_() {}
+
+SegmentRecorder::~SegmentRecorder() { Close(); }
+
+void SegmentRecorder::SetErrorHandler(OnErrorFn on_error) { on_error_ = std::move(on_error); }
+void SegmentRecorder::SetSegmentHandler(OnSegmentFn on_segment) { on_segment_ = std::move(on_segment); }
+
+void SegmentRecorder::SubmitError(Error&& error) const {
+    if (on_error_) {
+        on_error_(std::move(error));
+    }
+}
+
+void SegmentRecorder::Open(const RtmpServer::StreamInfo& info) {
+    Close();
+
+    dropping_ = false;
+    auto stream = info.stream;
+    writer_ = std::make_unique<std::jthread>([this, stream, key = info.stream_key](std::stop_token stoken) {
+        WriteWorker(stream, key, stoken);
+    });
+}
+
+void SegmentRecorder::Close() {
+    writer_.reset();
+    queue_.Clear();
+}
+
+void SegmentRecorder::Push(const AVPacket* packet) {
+    if (!writer_) {
+        return;
+    }
+
+    // Until the next keyframe whatever we record can't be decoded
+    if (dropping_ && !(packet->flags & AV_PKT_FLAG_KEY)) {
+        dropped_packets_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    auto ref = packet_pool_->Acquire();
+    int ret = av_packet_ref(ref.get(), packet);
+    if (ret < 0) {
+        SubmitError(av::MakeError(ret));
+        return;
+    }
+
+    dropping_ = !queue_.TryPush(std::move(ref));
+    if (dropping_) {
+        dropped_packets_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void SegmentRecorder::WriteWorker(const AVStream* stream, std::string stream_key, std::stop_token stoken) {
+    stream_ = stream;
+    stream_key_ = SanitizeFileName(stream_key);
+    segment_index_ = 0;
+
+    // A failed segment is dropped and recording resumes with a fresh one on the next keyframe, a full disk or a
+    // transient error shouldn't end the recording for the rest of the connection
+    auto write = [this](av::UniquePacketPtr& packet) {
+        auto result = Write(packet.get());
+        packet.reset();
+        if (!result) {
+            SubmitError(Error(std::format("Failed to record segment {}: {}", segment_path_, result.error().what())));
+            CloseSegment(false);
+        }
+    };
+
+    av::UniquePacketPtr packet;
+    while (queue_.Pop(packet, stoken)) {
+        write(packet);
+    }
+
+    // Stopping still records what was queued before
+    while (queue_.TryPop(packet)) {
+        write(packet);
+    }
+    CloseSegment(true);
+}
+
+auto SegmentRecorder::Write(AVPacket* packet) -> void_expected<av::Error> {
+    const bool keyframe = packet->flags & AV_PKT_FLAG_KEY;
+    if (keyframe && ShouldCut(packet)) {
+        CloseSegment(true);
+    }
+
+    // Segments start on a keyframe so each one plays on its own
+    if (!segment_ctx_) {
+        if (!keyframe) {
+            return kVoidExpected;
+        }
+        auto result = OpenSegment(packet->pts);
+        if (!result) {
+            return result;
+        }
+    }
+
+    auto out_stream = segment_ctx_->streams[0];
+    av_packet_rescale_ts(packet, stream_->time_base, out_stream->time_base);
+    packet->stream_index = 0;
+    packet->pos = -1;
+
+    int ret = av_write_frame(segment_ctx_.get(), packet);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+    return kVoidExpected;
+}
+
+auto SegmentRecorder::ShouldCut(const AVPacket* packet) const -> bool {
+    if (!segment_ctx_) {
+        return false;
+    }
+
+    if (settings_.max_bytes > 0 && static_cast<size_t>(avio_tell(segment_io_)) >= settings_.max_bytes) {
+        return true;
+    }
+
+    if (settings_.max_duration.count() > 0 && packet->pts != AV_NOPTS_VALUE) {
+        const auto elapsed = av_rescale_q(packet->pts - segment_start_pts_, stream_->time_base, AVRational{1, 1});
+        return elapsed >= settings_.max_duration.count();
+    }
+    return false;
+}
+
+auto SegmentRecorder::OpenSegment(int64_t start_pts) -> void_expected<av::Error> {
+    const bool mp4 = settings_.container == Container::kFragmentedMp4;
+    segment_path_ = std::format("{}/{}_{}_{:05}.{}", settings_.directory, stream_key_, Timestamp(), segment_index_++,
+                                mp4 ? "mp4" : "ts");
+    segment_start_pts_ = start_pts;
+
+    AVFormatContext* raw{};
+    int ret = avformat_alloc_output_context2(&raw, nullptr, mp4 ? "mp4" : "mpegts", nullptr);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+    segment_ctx_.reset(raw);
+
+    auto out_stream = avformat_new_stream(raw, nullptr);
+    if (!out_stream) {
+        return av::UnexpectedError(AVERROR(ENOMEM));
+    }
+    ret = avcodec_parameters_copy(out_stream->codecpar, stream_->codecpar);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+    // The input's tag belongs to its container, let the muxer pick its own
+    out_stream->codecpar->codec_tag = 0;
+    out_stream->time_base = stream_->time_base;
+
+    segment_fd_ = ::open(segment_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (segment_fd_ < 0) {
+        return UnexpectedError(std::format("Failed to create segment {}", segment_path_));
+    }
+
+    // Our own buffer instead of avio_open's 32KiB, every write to the file is a large sequential chunk
+    auto buffer = static_cast<uint8_t*>(av_malloc(settings_.write_buffer_size));
+    if (!buffer) {
+        return av::UnexpectedError(AVERROR(ENOMEM));
+    }
+    segment_io_ = avio_alloc_context(buffer, static_cast<int>(settings_.write_buffer_size), 1, &segment_fd_, nullptr,
+                                     WriteToFile, nullptr);
+    if (!segment_io_) {
+        av_free(buffer);
+        return av::UnexpectedError(AVERROR(ENOMEM));
+    }
+    raw->pb = segment_io_;
+    raw->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    AVDictionary* options{};
+    if (mp4) {
+        // Nothing is rewritten at the end, the file stays playable up to its last complete fragment
+        av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+    ret = avformat_write_header(raw, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+    header_written_ = true;
+    return kVoidExpected;
+}
+
+void SegmentRecorder::CloseSegment(bool complete) {
+    if (!segment_ctx_) {
+        return;
+    }
+
+    // After a failure only release everything, writing more would fail again
+    complete = complete && header_written_;
+    if (complete) {
+        av_write_trailer(segment_ctx_.get());
+    }
+    header_written_ = false;
+    if (segment_io_) {
+        if (complete) {
+            avio_flush(segment_io_);
+        }
+        av_freep(&segment_io_->buffer);
+        avio_context_free(&segment_io_);
+    }
+    segment_ctx_.reset();
+
+    if (segment_fd_ >= 0) {
+        ::close(segment_fd_);
+        segment_fd_ = -1;
+    }
+
+    if (complete && on_segment_) {
+        on_segment_(segment_path_);
+    }
+}
+
+}  // namespace oryx
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <functional>
+
+#include "av_helpers.hpp"
+#include "av_error.hpp"
+#include "blocking_queue.hpp"
+#include "rtmp_server.hpp"
+
+namespace oryx {
+
+/**
+ * @brief Archives one ingested stream as rolling fMP4 or MPEG-TS segments without re-encoding. Segments are cut on
+ * keyframes once they reach their duration or size limit. Muxing and file writes run on a dedicated I/O thread that
+ * writes in large chunks, the reader thread only queues packet references.
+ */
+class SegmentRecorder {
+public:
+    enum class Container {
+        kFragmentedMp4,  // Fragment per keyframe, playable while written and after a crash
+        kMpegTs,
+    };
+
+    struct Settings {
+        std::string directory;
+        Container container{Container::kMpegTs};
+        std::chrono::seconds max_duration{60};  // Cut at the first keyframe past this, 0 for no limit
+        size_t max_bytes{};                     // Cut at the first keyframe past this, 0 for no limit
+        size_t queue_size{512};
+        size_t write_buffer_size{1 << 20};  // Bytes collected before each write to the file
+    };
+
+    using OnErrorFn = std::function<void(Error)>;
+    using OnSegmentFn = std::function<void(const std::string& path)>;
+
+    SegmentRecorder(Settings settings);
+    ~SegmentRecorder();
+
+    /**
+     * @brief Starts recording stream. Call from the server's connected handler
+     */
+    void Open(const RtmpServer::StreamInfo& info);
+
+    /**
+     * @brief Queues a reference of packet for the I/O thread. Call from the server's packet handler
+     */
+    void Push(const AVPacket* packet);
+
+    /**
+     * @brief Writes everything queued and finishes the current segment. Call from the server's disconnected handler
+     * at the latest, the I/O thread reads the stream passed to Open
+     */
+    void Close();
+
+    void SetErrorHandler(OnErrorFn on_error);
+
+    /**
+     * @brief Called on the I/O thread with the path of every finished segment
+     */
+    void SetSegmentHandler(OnSegmentFn on_segment);
+
+    auto dropped_packets() const -> uint64_t { return dropped_packets_.load(std::memory_order_relaxed); }
+
+private:
+    void SubmitError(Error&& error) const;
+    void WriteWorker(const AVStream* stream, std::string stream_key, std::stop_token stoken);
+    auto Write(AVPacket* packet) -> void_expected<av::Error>;
+    auto OpenSegment(int64_t start_pts) -> void_expected<av::Error>;
+    /**
+     * @brief Finishes the current segment. Failed segments aren't completed or handed to the segment handler
+     */
+    void CloseSegment(bool complete);
+    auto ShouldCut(const AVPacket* packet) const -> bool;
+
+    Settings settings_;
+    OnErrorFn on_error_;
+    OnSegmentFn on_segment_;
+    std::atomic<uint64_t> dropped_packets_;
+    std::shared_ptr<av::PacketPool> packet_pool_;
+    BlockingQueue<av::UniquePacketPtr> queue_;
+    bool dropping_;  // Reader side drop until keyframe state
+
+    // Owned by the I/O thread
+    const AVStream* stream_;
+    std::string stream_key_;
+    size_t segment_index_;
+    std::string segment_path_;
+    int64_t segment_start_pts_;
+    av::UniqueFormatContextPtr segment_ctx_;
+    AVIOContext* segment_io_;
+    int segment_fd_;
+    bool header_written_;
+
+    std::unique_ptr<std::jthread> writer_;
+};
+
+}  // namespace oryx
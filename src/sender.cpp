@@ -3,6 +3,12 @@
 #include <format>
 #include <csignal>
 #include <atomic>
+#include <chrono>
+#include <cstring>
+#include <optional>
+#include <vector>
+#include <thread>
+#include <algorithm>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/utils/logger.hpp>
@@ -17,70 +23,203 @@ extern "C" {
 #include <oryx/chrono/frame_rate_controller.hpp>
 #include <oryx/argparse.hpp>
 
+#include "cpu_features.hpp"
+#include "frame_timestamp.hpp"
 #include "h264_encoder.hpp"
+#include "rendition_encoder.hpp"
+#include "blocking_queue.hpp"
+#include "rtmp_output.hpp"
 
 using std::println;
 using namespace oryx;
 
 using ImageGenerator = std::generator<Image>;
 
-static auto CreateRgbFlowEffectGenerator(ImageSize size, int frame_rate, auto should_stop) -> ImageGenerator {
-    const auto [width, height] = size;
-    const auto tp = cv::Point(width / 2, height / 2);
-    const auto tc = cv::Scalar(0, 0, 255);
+static std::atomic_bool should_exit{};
 
-    chrono::FrameRateController fr_controller(frame_rate);
-    Image yuv(height + height / 2, width, CV_8UC1);
-    Image bgr;
-    int index{};
-    std::string text;
+// Fills an I420 image with moving gradients. Every row is a plain memcpy or memset from a precomputed ramp so the
+// fills run at memory bandwidth instead of per pixel.
+class FlowEffectFiller {
+public:
+    explicit FlowEffectFiller(ImageSize size) : size_(size), ramp_(size.width + 256) {
+        for (size_t i = 0; i < ramp_.size(); i++) {
+            ramp_[i] = static_cast<uint8_t>(i);
+        }
+    }
 
-    while (!should_stop()) {
-        // Fill Y plane
+    void Fill(Image& yuv, int index) const {
+        const auto [width, height] = size_;
+        uint8_t* y_plane = yuv.data;
+        uint8_t* u_plane = y_plane + width * height;
+        uint8_t* v_plane = u_plane + (width / 2) * (height / 2);
+
+        // Y = x + y + index * 3, a row is the ramp shifted by its start value
         for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                yuv.at<uchar>(y, x) = x + y + index * 3;
-            }
+            std::memcpy(y_plane + y * width, Ramp(y + index * 3), width);
         }
 
-        // Fill U (Cb) plane
+        // U = 128 + y + index * 2, constant per row
         for (int y = 0; y < height / 2; y++) {
-            for (int x = 0; x < width / 2; x++) {
-                yuv.at<uchar>(height + y, x * 2) = 128 + y + index * 2;
-            }
+            std::memset(u_plane + y * (width / 2), static_cast<uint8_t>(128 + y + index * 2), width / 2);
         }
 
-        // Fill V (Cr) plane
+        // V = 64 + x + index * 5, the same row every line
+        const uint8_t* v_row = Ramp(64 + index * 5);
         for (int y = 0; y < height / 2; y++) {
-            for (int x = 0; x < width / 2; x++) {
-                yuv.at<uchar>(height + y, x * 2 + 1) = 64 + x + index * 5;
-            }
+            std::memcpy(v_plane + y * (width / 2), v_row, width / 2);
         }
+    }
 
-        text = std::format("{}", index);
-        cv::cvtColor(yuv, bgr, cv::COLOR_YUV420p2BGR);
-        cv::putText(bgr, text, tp, cv::FONT_HERSHEY_SIMPLEX, 2.0, tc);
+private:
+    auto Ramp(int start) const -> const uint8_t* { return ramp_.data() + (start & 0xff); }
+
+    ImageSize size_;
+    ByteVector ramp_;
+};
+
+/**
+ * @param yuv Yield the I420 image as is instead of converting to BGR and drawing the frame index
+ * @param frame_rate Frames per second to generate at, 0 generates as fast as possible
+ * @param acquire Returns the image to write the next frame into, called with rows, cols and type
+ */
+static auto CreateFlowEffectGenerator(ImageSize size, int frame_rate, bool yuv, auto acquire, auto should_stop)
+    -> ImageGenerator {
+    const auto [width, height] = size;
+    const auto tp = cv::Point(width / 2, height / 2);
+    const auto tc = cv::Scalar(0, 0, 255);
+
+    std::optional<chrono::FrameRateController> fr_controller;
+    if (frame_rate > 0) {
+        fr_controller.emplace(frame_rate);
+    }
+
+    const FlowEffectFiller filler(size);
+    Image i420(height + height / 2, width, CV_8UC1);
+    int index{};
+
+    while (!should_stop()) {
+        if (yuv) {
+            Image image = acquire(height + height / 2, width, CV_8UC1);
+            filler.Fill(image, index);
+            co_yield std::move(image);
+        } else {
+            filler.Fill(i420, index);
+            Image bgr = acquire(height, width, CV_8UC3);
+            cv::cvtColor(i420, bgr, cv::COLOR_YUV2BGR_I420);
+            cv::putText(bgr, std::format("{}", index), tp, cv::FONT_HERSHEY_SIMPLEX, 2.0, tc);
+            co_yield std::move(bgr);
+        }
 
-        co_yield bgr;
         index++;
-        fr_controller.Sleep();
+        if (fr_controller) {
+            fr_controller->Sleep();
+        }
     }
 }
 
-static auto CreateCameraGenerator(cv::VideoCapture& cap, auto should_stop) -> ImageGenerator {
+// Generates frames without encoding or sending and reports how many per second the generator can produce
+static auto RunMaxFpsBenchmark(ImageSize size, bool yuv, std::chrono::milliseconds duration) -> int {
+    using Clock = std::chrono::steady_clock;
+
+    println("Generating {}x{} {} frames for {}ms", size.width, size.height, yuv ? "I420" : "BGR", duration.count());
+    const auto start = Clock::now();
+    auto last_report = start;
+    uint64_t frames{};
+    uint64_t last_frames{};
+
+    Image scratch;
+    auto acquire = [&scratch](int rows, int cols, int type) {
+        scratch.create(rows, cols, type);
+        return scratch;
+    };
+    auto should_stop = [&] { return should_exit.load(std::memory_order_relaxed) || Clock::now() - start >= duration; };
+    for (const auto& image : CreateFlowEffectGenerator(size, 0, yuv, acquire, should_stop)) {
+        static_cast<void>(image);
+        frames++;
+
+        const auto now = Clock::now();
+        if (now - last_report >= std::chrono::seconds(1)) {
+            const std::chrono::duration<double> elapsed = now - last_report;
+            println("Generated fps={:.1f}", (frames - last_frames) / elapsed.count());
+            last_report = now;
+            last_frames = frames;
+        }
+    }
+
+    const std::chrono::duration<double> elapsed = Clock::now() - start;
+    println("Max fps={:.1f} frames={} elapsed={:.2f}s", frames / elapsed.count(), frames, elapsed.count());
+    return 0;
+}
+
+static auto CreateCameraGenerator(cv::VideoCapture& cap, auto acquire, auto should_stop) -> ImageGenerator {
     Image image;
     while (!should_stop()) {
         if (!cap.read(image)) {
             println("End of video");
             break;
         }
-        Image bgr;
+        Image bgr = acquire(image.rows, image.cols, CV_8UC3);
         cv::cvtColor(image, bgr, cv::COLOR_RGB2BGR);
-        co_yield bgr;
+        co_yield std::move(bgr);
     }
 }
 
-static std::atomic_bool should_exit{};
+// Encoded packet on its way to the output of its rendition
+struct RenditionPacket {
+    size_t rendition;
+    av::UniquePacketPtr packet;
+};
+
+// Fixed set of images cycled from the capture to the encode stage and back, so a frame is never overwritten while
+// it is still queued or encoding. Acquire and Release have to be called from one thread each.
+class ImagePool {
+public:
+    explicit ImagePool(size_t size) : free_(size), size_(size), allocated_() {}
+
+    // Blocks while every image is in flight
+    auto Acquire(int rows, int cols, int type) -> Image {
+        Image image;
+        if (allocated_ < size_) {
+            allocated_++;
+        } else {
+            free_.Pop(image, {});
+        }
+        image.create(rows, cols, type);
+        return image;
+    }
+
+    void Release(Image&& image) { free_.TryPush(std::move(image)); }
+
+private:
+    BlockingQueue<Image> free_;
+    size_t size_;
+    size_t allocated_;
+};
+
+// Items handled and time spent by one pipeline stage. Written by the stage, read by the reporter
+struct StageCounters {
+    struct Snapshot {
+        uint64_t items;
+        uint64_t busy_ns;
+    };
+
+    void Add(std::chrono::steady_clock::duration busy) {
+        items.fetch_add(1, std::memory_order_relaxed);
+        busy_ns.fetch_add(std::chrono::nanoseconds(busy).count(), std::memory_order_relaxed);
+    }
+
+    // Items per second and average busy milliseconds per item since last, which is updated
+    auto Rates(Snapshot& last, double seconds) const -> std::pair<double, double> {
+        const Snapshot now{items.load(std::memory_order_relaxed), busy_ns.load(std::memory_order_relaxed)};
+        const auto count = now.items - last.items;
+        const auto busy_ms = (now.busy_ns - last.busy_ns) / 1e6;
+        last = now;
+        return {count / seconds, count ? busy_ms / count : 0.0};
+    }
+
+    std::atomic<uint64_t> items;
+    std::atomic<uint64_t> busy_ns;
+};
 
 auto main(int argc, char* argv[]) -> int {
     if (argc < 2) {
@@ -99,6 +238,13 @@ auto main(int argc, char* argv[]) -> int {
     const std::string window_name{"RTMP Sender"};
     std::string url{};
     bool display_image{};
+    bool yuv{};
+    bool drop_on_full{};
+    bool stamp_time{};
+    size_t queue_size{8};
+    ImageSize synthetic_size(1280, 720);
+    int synthetic_fps{30};
+    std::chrono::milliseconds duration{5000};
 
     cli.VisitIfContains<std::string>("--url", [&url](std::string url_) {
         println("Using user provided url={}", url_);
@@ -109,6 +255,43 @@ auto main(int argc, char* argv[]) -> int {
         display_image = true;
     }
 
+    if (cli.Contains("--yuv")) {
+        yuv = true;
+    }
+
+    if (cli.Contains("--drop-on-full")) {
+        drop_on_full = true;
+    }
+
+    if (cli.Contains("--stamp-time")) {
+        stamp_time = true;
+    }
+
+    cli.VisitIfContains<std::string>("--queue-size", [&queue_size](std::string value) {
+        queue_size = std::max<size_t>(std::stoul(value), 1);
+    });
+
+    cli.VisitIfContains<std::string>("--size", [&synthetic_size](std::string value) {
+        auto pos = value.find('x');
+        if (pos == std::string::npos) {
+            println("Ignoring invalid size {}, expected WIDTHxHEIGHT", value);
+            return;
+        }
+        synthetic_size = ImageSize(std::stoi(value.substr(0, pos)), std::stoi(value.substr(pos + 1)));
+    });
+
+    cli.VisitIfContains<std::string>("--fps", [&synthetic_fps](std::string value) {
+        synthetic_fps = std::stoi(value);
+    });
+
+    cli.VisitIfContains<std::string>("--duration", [&duration](std::string value) {
+        duration = std::chrono::milliseconds(std::stoll(value));
+    });
+
+    if (cli.Contains("--max-fps")) {
+        return RunMaxFpsBenchmark(synthetic_size, yuv, duration);
+    }
+
     if (display_image) {
         try {
             cv::namedWindow(window_name, cv::WINDOW_AUTOSIZE);
@@ -126,91 +309,191 @@ auto main(int argc, char* argv[]) -> int {
     H264Encoder::Settings settings;
 
     if (!cap.isOpened()) {
-        settings.size = ImageSize(1280, 720);
+        settings.size = synthetic_size;
         settings.bitrate = 4000000;
-        settings.frame_rate = 30;
+        settings.frame_rate = synthetic_fps;
+        settings.input_format = yuv ? PixelFormat::kYuv420p : PixelFormat::kBgr24;
     } else {
         settings.size = ImageSize(cap.get(cv::CAP_PROP_FRAME_WIDTH), cap.get(cv::CAP_PROP_FRAME_HEIGHT));
         settings.frame_rate = cap.get(cv::CAP_PROP_FPS);
         settings.bitrate = 4000000;
     }
-    println("H264 Encoder settings width={} height={} fps={} bitrate={}", settings.size.width, settings.size.height,
-            settings.frame_rate, settings.bitrate);
 
-    H264Encoder encoder{};
-    auto result = encoder.Open(settings);
-    if (!result) {
-        println("Open Encoder failed with error {}", result.error().what());
-        return 1;
-    }
+    cli.VisitIfContains<std::string>("--profile", [&settings](std::string profile) {
+        if (profile == "low-latency") {
+            settings.profile = H264Encoder::Profile::LowLatency();
+        } else if (profile == "high-throughput") {
+            settings.profile = H264Encoder::Profile::HighThroughput();
+        } else {
+            println("Unknown profile {}, using encoder defaults", profile);
+        }
+    });
+
+    cli.VisitIfContains<std::string>("--bitrate", [&settings](std::string value) {
+        settings.bitrate = std::stoi(value) * 1000;
+    });
+
+    cli.VisitIfContains<std::string>("--keyframe-interval", [&settings](std::string value) {
+        settings.profile.keyframe_interval = std::stoi(value);
+    });
 
-    av::UniqueFormatContextPtr fmt_ctx([] {
-        AVFormatContext* raw{};
-        avformat_alloc_output_context2(&raw, nullptr, "flv", nullptr);
-        return raw;
-    }());
+    // Every rendition publishes to its own url, named after the base url and the rendition's height
+    RenditionEncoder::Settings encoder_settings;
+    encoder_settings.size = settings.size;
+    encoder_settings.frame_rate = settings.frame_rate;
+    encoder_settings.profile = settings.profile;
+    encoder_settings.renditions.push_back({settings.size, settings.bitrate});
+    std::vector<std::string> urls{url};
+
+    cli.VisitIfContains<std::string>("--renditions", [&](std::string value) {
+        encoder_settings.renditions.clear();
+        urls.clear();
+        size_t start{};
+        while (start < value.size()) {
+            auto end = std::min(value.find(',', start), value.size());
+            auto rendition = value.substr(start, end - start);
+            start = end + 1;
+
+            auto x = rendition.find('x');
+            auto at = rendition.find('@');
+            if (x == std::string::npos || at == std::string::npos || at < x) {
+                println("Ignoring invalid rendition {}, expected WIDTHxHEIGHT@KBITS", rendition);
+                continue;
+            }
+            const ImageSize size(std::stoi(rendition.substr(0, x)), std::stoi(rendition.substr(x + 1, at - x - 1)));
+            encoder_settings.renditions.push_back({size, std::stoi(rendition.substr(at + 1)) * 1000});
+            urls.push_back(std::format("{}_{}p", url, size.height));
+        }
+    });
 
-    if (!fmt_ctx) {
-        println("Failed to alloc format context");
+    if (encoder_settings.renditions.empty()) {
+        println("No valid rendition given");
         return 1;
     }
 
-    auto codec_ctx = encoder.codec_ctx();
-    auto video_stream = avformat_new_stream(fmt_ctx.get(), codec_ctx->codec);
-    int ret = avcodec_parameters_from_context(video_stream->codecpar, codec_ctx);
-    if (ret < 0) {
-        println("Could not initialize stream codec params with error={}", av_err2str(ret));
-        return 1;
+    for (size_t i = 0; i < urls.size(); i++) {
+        const auto& rendition = encoder_settings.renditions[i];
+        println("H264 Encoder settings width={} height={} fps={} bitrate={} url={}", rendition.size.width,
+                rendition.size.height, settings.frame_rate, rendition.bitrate, urls[i]);
     }
 
-    println("Trying to connect to {}", url);
-    av::UniqueIoContextPtr rtmp_ctx{[&] {
-        AVIOContext* raw;
-        avio_open2(&raw, url.c_str(), AVIO_FLAG_WRITE, nullptr, nullptr);
-        return raw;
-    }()};
-    if (!rtmp_ctx) {
-        println("Failed to establish connection", url);
+    println("SIMD {}", ToString(DetectCpuFeatures()));
+    RenditionEncoder encoder{};
+    auto result = encoder.Open(encoder_settings);
+    if (!result) {
+        println("Open Encoder failed with error {}", result.error().what());
         return 1;
     }
 
-    av_opt_set(fmt_ctx.get(), "rtmp_live", "live", 0);
-    fmt_ctx->pb = rtmp_ctx.get();
-
-    ret = avformat_write_header(fmt_ctx.get(), nullptr);
-    if (ret < 0) {
-        println("Could not write header!");
-        return 1;
+    std::vector<std::unique_ptr<RtmpOutput>> outputs;
+    for (size_t i = 0; i < urls.size(); i++) {
+        println("Trying to connect to {}", urls[i]);
+        auto output = std::make_unique<RtmpOutput>();
+        result = output->Open(urls[i], encoder.codec_ctx(i));
+        if (!result) {
+            println("Failed to establish connection to {} with error {}", urls[i], result.error().what());
+            return 1;
+        }
+        outputs.push_back(std::move(output));
     }
 
+    // Capture runs on this thread, encoding and writing each on their own, connected by bounded queues. Encoded
+    // packets are dropped until the next keyframe on a full network queue with --drop-on-full, so a stalled socket
+    // never holds up capture and encoding.
+    using Clock = std::chrono::steady_clock;
+    ImagePool image_pool(queue_size + 2);
+    BlockingQueue<Image> capture_queue(queue_size);
+    BlockingQueue<RenditionPacket> packet_queue(queue_size * urls.size());
+    StageCounters capture_counters{};
+    StageCounters encode_counters{};
+    StageCounters write_counters{};
+    std::atomic<uint64_t> dropped_packets{};
+
+    std::jthread writer([&](std::stop_token stoken) {
+        RenditionPacket item;
+        while (packet_queue.Pop(item, stoken)) {
+            const auto start = Clock::now();
+            if (!outputs[item.rendition]->Write(item.packet.get())) {
+                println("Failed to write packet!");
+            }
+            write_counters.Add(Clock::now() - start);
+        }
+    });
+
+    // Only the synthetic source produces I420, camera frames are always BGR
+    const auto input_format = cap.isOpened() ? PixelFormat::kBgr24 : settings.input_format;
+    std::jthread encode_worker([&](std::stop_token stoken) {
+        std::vector<char> dropping(urls.size());
+        RenditionEncoder::OnPacketFn on_packet = [&](size_t rendition, av::UniquePacketPtr packet) {
+            RenditionPacket item{rendition, std::move(packet)};
+            if (!drop_on_full) {
+                packet_queue.Push(std::move(item), stoken);
+                return;
+            }
+            // Everything up to the next keyframe of the rendition references what we dropped
+            if (!dropping[rendition] || (item.packet->flags & AV_PKT_FLAG_KEY)) {
+                dropping[rendition] = !packet_queue.TryPush(std::move(item));
+            }
+            if (dropping[rendition]) {
+                dropped_packets.fetch_add(1, std::memory_order_relaxed);
+            }
+        };
+
+        Image image;
+        while (capture_queue.Pop(image, stoken)) {
+            const auto start = Clock::now();
+            const auto result = encoder.Encode(image, input_format, on_packet);
+            encode_counters.Add(Clock::now() - start);
+            if (!result) {
+                println("Encode failed. {}", result.error().what());
+            }
+            image_pool.Release(std::move(image));
+        }
+    });
+
+    auto acquire = [&image_pool](int rows, int cols, int type) { return image_pool.Acquire(rows, cols, type); };
     auto generator_should_stop = [] { return should_exit.load(std::memory_order_relaxed); };
     auto generator = [&] {
         if (cap.isOpened())
-            return CreateCameraGenerator(cap, generator_should_stop);
+            return CreateCameraGenerator(cap, acquire, generator_should_stop);
         else
-            return CreateRgbFlowEffectGenerator(settings.size, settings.frame_rate, generator_should_stop);
+            return CreateFlowEffectGenerator(settings.size, settings.frame_rate, yuv, acquire, generator_should_stop);
     }();
 
-    for (const auto& image : generator) {
-        const auto result = encoder.Encode(image, [&](av::UniquePacketPtr pkt) {
-            av_packet_rescale_ts(pkt.get(), codec_ctx->time_base, video_stream->time_base);
-            pkt->stream_index = video_stream->index;
-            ret = av_interleaved_write_frame(fmt_ctx.get(), pkt.get());
-            if (ret < 0) {
-                println("Failed to write packet!");
-            }
-        });
-
-        if (!result) {
-            println("Encode failed. {}", result.error().what());
+    StageCounters::Snapshot last_capture{};
+    StageCounters::Snapshot last_encode{};
+    StageCounters::Snapshot last_write{};
+    auto last_report = Clock::now();
+    for (auto&& image : generator) {
+        // Stamped as late as possible so the measured latency starts where capture ends
+        if (stamp_time) {
+            StampFrameTime(image, std::chrono::system_clock::now());
         }
 
         if (display_image) {
             cv::imshow("Test", image);
             cv::waitKey(1);
         }
+
+        // Capture time is the time spent waiting for room in the encode queue
+        const auto start = Clock::now();
+        capture_queue.Push(std::move(image), {});
+        capture_counters.Add(Clock::now() - start);
+
+        const auto now = Clock::now();
+        if (now - last_report >= std::chrono::seconds(1)) {
+            const std::chrono::duration<double> elapsed = now - last_report;
+            const auto [capture_fps, capture_ms] = capture_counters.Rates(last_capture, elapsed.count());
+            const auto [encode_fps, encode_ms] = encode_counters.Rates(last_encode, elapsed.count());
+            const auto [write_pps, write_ms] = write_counters.Rates(last_write, elapsed.count());
+            println("capture fps={:.1f} blocked={:.2f}ms | encode fps={:.1f} avg={:.2f}ms | write pps={:.1f} "
+                    "avg={:.2f}ms dropped={}",
+                    capture_fps, capture_ms, encode_fps, encode_ms, write_pps, write_ms,
+                    dropped_packets.load(std::memory_order_relaxed));
+            last_report = now;
+        }
     }
 
     println("Exiting");
     return 0;
-}
\ No newline at end of file
+}
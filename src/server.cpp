@@ -1,19 +1,38 @@
+#include <map>
+#include <mutex>
 #include <print>
+#include <algorithm>
 
 #include <csignal>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/utils/logger.hpp>
 
+extern "C" {
+#include <libavcodec/packet.h>
+}
+
 #include <oryx/enchantum.hpp>
 #include <oryx/argparse.hpp>
 
 #include "rtmp_server.hpp"
+#include "rtmp_multi_server.hpp"
+#include "rtmp_relay.hpp"
+#include "segment_recorder.hpp"
+#include "frame_timestamp.hpp"
+#include "cpu_features.hpp"
 
 using std::println;
 using namespace oryx;
 
 std::unique_ptr<RtmpServer> server;
+std::unique_ptr<RtmpMultiServer> multi_server;
+std::unique_ptr<RtmpRelay> relay;
+std::unique_ptr<SegmentRecorder> recorder;
+
+static auto ToMicros(std::chrono::nanoseconds duration) -> int64_t {
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
@@ -24,6 +43,9 @@ int main(int argc, char* argv[]) {
     signal(SIGINT, [](int) {
         println("\nUser Interrupt");
         server.reset();
+        multi_server.reset();
+        relay.reset();
+        recorder.reset();
         exit(0);
     });
 
@@ -35,16 +57,207 @@ int main(int argc, char* argv[]) {
     settings.buffer_time = std::chrono::milliseconds(1000);
     settings.queue_size = 64;
     bool display_image{};
+    bool measure_latency{};
+    size_t max_sessions{};
+    size_t decode_threads{};
+    std::vector<int> decode_cpus;
+    int decode_numa_node{-1};
+    RtmpRelay::Settings relay_settings;
+    relay_settings.queue_size = 256;
+    SegmentRecorder::Settings record_settings;
 
     cli.VisitIfContains<std::string>("--url", [&settings](std::string url_) {
         println("Using user provided url={}", url_);
         settings.url = url_;
     });
 
+    cli.VisitIfContains<std::string>("--overflow", [&settings](std::string policy) {
+        if (policy == "block") {
+            settings.overflow_policy = RtmpServer::OverflowPolicy::kBlock;
+        } else if (policy == "drop-gop") {
+            settings.overflow_policy = RtmpServer::OverflowPolicy::kDropOldestGop;
+        } else {
+            settings.overflow_policy = RtmpServer::OverflowPolicy::kDropUntilKeyframe;
+        }
+        println("Using overflow policy={}", enchantum::to_string(settings.overflow_policy));
+    });
+
+    cli.VisitIfContains<std::string>("--format", [&settings](std::string format) {
+        if (format == "native") {
+            settings.output_format = PixelFormat::kNative;
+        } else if (format == "nv12") {
+            settings.output_format = PixelFormat::kNv12;
+        } else if (format == "yuv420p") {
+            settings.output_format = PixelFormat::kYuv420p;
+        } else if (format == "gray") {
+            settings.output_format = PixelFormat::kGray8;
+        } else {
+            settings.output_format = PixelFormat::kBgr24;
+        }
+        println("Using output format={}", enchantum::to_string(settings.output_format));
+    });
+
+    if (cli.Contains("--no-decode")) {
+        println("Decoding disabled, only forwarding packets");
+        settings.decode = false;
+    }
+
+    cli.VisitIfContains<std::string>("--decoder-threads", [&settings](std::string value) {
+        settings.decoder_threads = std::stoi(value);
+    });
+
+    cli.VisitIfContains<std::string>("--decoder-thread-type", [&settings](std::string type) {
+        if (type == "frame") {
+            settings.decoder_thread_type = RtmpServer::DecoderThreadType::kFrame;
+        } else if (type == "slice") {
+            settings.decoder_thread_type = RtmpServer::DecoderThreadType::kSlice;
+        } else {
+            settings.decoder_thread_type = RtmpServer::DecoderThreadType::kAuto;
+        }
+    });
+
+    if (cli.Contains("--low-delay")) {
+        settings.low_delay = true;
+    }
+
+    cli.VisitIfContains<std::string>("--convert-threads", [&settings](std::string value) {
+        settings.convert_threads = std::stoul(value);
+        println("Converting on {} threads", settings.convert_threads);
+    });
+
+    cli.VisitIfContains<std::string>("--relay", [&relay_settings](std::string urls) {
+        size_t start{};
+        while (start < urls.size()) {
+            auto end = std::min(urls.find(',', start), urls.size());
+            relay_settings.urls.push_back(urls.substr(start, end - start));
+            println("Relaying to {}", relay_settings.urls.back());
+            start = end + 1;
+        }
+    });
+
+    cli.VisitIfContains<std::string>("--record", [&record_settings](std::string directory) {
+        println("Recording to {}", directory);
+        record_settings.directory = directory;
+    });
+
+    cli.VisitIfContains<std::string>("--record-format", [&record_settings](std::string format) {
+        if (format == "ts") {
+            record_settings.container = SegmentRecorder::Container::kMpegTs;
+        } else if (format == "mp4") {
+            record_settings.container = SegmentRecorder::Container::kFragmentedMp4;
+        } else {
+            println("Unknown record format {}, expected ts|mp4", format);
+        }
+    });
+
+    cli.VisitIfContains<std::string>("--segment-duration", [&record_settings](std::string value) {
+        record_settings.max_duration = std::chrono::seconds(std::stoll(value));
+    });
+
+    cli.VisitIfContains<std::string>("--segment-size", [&record_settings](std::string value) {
+        record_settings.max_bytes = std::stoull(value) << 20;
+    });
+
+    cli.VisitIfContains<std::string>("--max-sessions", [&max_sessions](std::string value) {
+        max_sessions = std::stoul(value);
+        println("Accepting up to {} concurrent publishers", max_sessions);
+    });
+
+    cli.VisitIfContains<std::string>("--decode-threads", [&decode_threads](std::string value) {
+        decode_threads = std::stoul(value);
+    });
+
+    cli.VisitIfContains<std::string>("--decode-cpus", [&decode_cpus](std::string value) {
+        size_t begin = 0;
+        while (begin < value.size()) {
+            auto end = std::min(value.find(',', begin), value.size());
+            decode_cpus.push_back(std::stoi(value.substr(begin, end - begin)));
+            begin = end + 1;
+        }
+    });
+
+    cli.VisitIfContains<std::string>("--decode-numa-node", [&decode_numa_node](std::string value) {
+        decode_numa_node = std::stoi(value);
+    });
+
+    cli.VisitIfContains<std::string>("--start", [&settings](std::string mode) {
+        if (mode == "probe") {
+            settings.start_mode = RtmpServer::StartMode::kProbe;
+        } else if (mode == "fast") {
+            settings.start_mode = RtmpServer::StartMode::kFastProbe;
+        } else if (mode == "header") {
+            settings.start_mode = RtmpServer::StartMode::kSequenceHeader;
+        } else {
+            println("Unknown start mode {}, expected probe|fast|header", mode);
+        }
+    });
+
+    cli.VisitIfContains<std::string>("--decimate", [&settings](std::string mode) {
+        auto pos = mode.find(':');
+        auto name = mode.substr(0, pos);
+        auto value = pos == std::string::npos ? std::string() : mode.substr(pos + 1);
+        if (name == "keyframes") {
+            settings.decimation = RtmpServer::Decimation::kKeyframes;
+        } else if (name == "every" && !value.empty()) {
+            settings.decimation = RtmpServer::Decimation::kEveryNth;
+            settings.decimation_interval = std::max(std::stoi(value), 1);
+        } else if (name == "rate" && !value.empty()) {
+            settings.decimation = RtmpServer::Decimation::kRate;
+            settings.delivery_rate = std::stod(value);
+        } else {
+            println("Unknown decimation {}, expected keyframes|every:N|rate:FPS", mode);
+        }
+    });
+
+    cli.VisitIfContains<std::string>("--output-size", [&settings](std::string value) {
+        auto pos = value.find('x');
+        if (pos == std::string::npos) {
+            println("Ignoring invalid output size {}, expected WIDTHxHEIGHT", value);
+            return;
+        }
+        settings.output_size = ImageSize(std::stoi(value.substr(0, pos)), std::stoi(value.substr(pos + 1)));
+    });
+
+    cli.VisitIfContains<std::string>("--scale", [&settings](std::string algorithm) {
+        if (algorithm == "fast-bilinear") {
+            settings.scale_algorithm = RtmpServer::ScaleAlgorithm::kFastBilinear;
+        } else if (algorithm == "bilinear") {
+            settings.scale_algorithm = RtmpServer::ScaleAlgorithm::kBilinear;
+        } else if (algorithm == "bicubic") {
+            settings.scale_algorithm = RtmpServer::ScaleAlgorithm::kBicubic;
+        } else if (algorithm == "area") {
+            settings.scale_algorithm = RtmpServer::ScaleAlgorithm::kArea;
+        } else if (algorithm == "lanczos") {
+            settings.scale_algorithm = RtmpServer::ScaleAlgorithm::kLanczos;
+        } else {
+            println("Unknown scale algorithm {}, expected fast-bilinear|bilinear|bicubic|area|lanczos", algorithm);
+        }
+    });
+
+    if (cli.Contains("--skip-loop-filter")) {
+        settings.skip_loop_filter = true;
+    }
+
+    cli.VisitIfContains<std::string>("--lowres", [&settings](std::string value) {
+        settings.lowres = std::stoi(value);
+    });
+
+    cli.VisitIfContains<std::string>("--buffer-time", [&settings](std::string value) {
+        settings.buffer_time = std::chrono::milliseconds(std::stoll(value));
+    });
+
+    cli.VisitIfContains<std::string>("--queue-size", [&settings](std::string value) {
+        settings.queue_size = std::max<size_t>(std::stoul(value), 1);
+    });
+
     if (cli.Contains("--display")) {
         display_image = true;
     }
 
+    if (cli.Contains("--measure-latency")) {
+        measure_latency = true;
+    }
+
     if (display_image) {
         try {
             cv::namedWindow(window_name, cv::WINDOW_AUTOSIZE);
@@ -54,26 +267,156 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    println("SIMD {}", ToString(DetectCpuFeatures()));
+
+    if (max_sessions > 0 && (!relay_settings.urls.empty() || !record_settings.directory.empty())) {
+        println("--relay and --record follow a single publisher and can't be combined with --max-sessions");
+        return 1;
+    }
+
+    if (max_sessions > 0) {
+        // highgui is not thread safe. Pool threads only hand the latest frame of every stream to the main thread
+        std::mutex display_mutex;
+        std::map<std::string, VideoFrame> display_frames;
+        SampleRecorder glass_to_glass;
+
+        RtmpMultiServer::Settings multi_settings;
+        multi_settings.session = settings;
+        multi_settings.max_sessions = max_sessions;
+        multi_settings.decode_threads = decode_threads;
+        multi_settings.decode_cpus = decode_cpus;
+        multi_settings.decode_numa_node = decode_numa_node;
+
+        multi_server = std::make_unique<RtmpMultiServer>(multi_settings);
+        multi_server->SetErrorHandler([](Error error) { println("Server error={}", error.what()); });
+        multi_server->SetSessionHandler([&](const RtmpMultiServer::SessionInfo& session) {
+            auto counter = std::make_shared<int>();
+            RtmpServer::Handlers handlers;
+            handlers.on_connect = [id = session.id](RtmpServer::StreamInfo info) {
+                println("[{}] Client connected stream_key={} codec={} fmt={} width={} height={}", id, info.stream_key,
+                        info.codec, info.stream_fmt, info.resolution.width, info.resolution.height);
+            };
+            handlers.on_disconnect = [id = session.id] { println("[{}] Client disconnected", id); };
+            handlers.on_error = [id = session.id](Error error) { println("[{}] Session error={}", id, error.what()); };
+            handlers.on_frame = [&, counter, key = session.stream_key](VideoFrame frame) {
+                if (measure_latency) {
+                    if (auto captured = ReadFrameTime(frame.image())) {
+                        glass_to_glass.Record(std::chrono::system_clock::now() - *captured);
+                    }
+                } else if (display_image) {
+                    std::lock_guard lock(display_mutex);
+                    display_frames[key] = std::move(frame);
+                } else {
+                    println("[{}] Decoded image={}", key, (*counter)++);
+                }
+            };
+            return handlers;
+        });
+        multi_server->Start();
+
+        auto last_report = std::chrono::steady_clock::now();
+        while (1) {
+            if (display_image) {
+                std::map<std::string, VideoFrame> frames;
+                {
+                    std::lock_guard lock(display_mutex);
+                    frames.swap(display_frames);
+                }
+                for (const auto& [key, frame] : frames) {
+                    cv::imshow(key, frame.image());
+                }
+                cv::waitKey(10);
+            } else {
+                usleep(10000);
+            }
+
+            const auto now = std::chrono::steady_clock::now();
+            if (measure_latency && now - last_report >= std::chrono::seconds(1)) {
+                last_report = now;
+                const auto glass = glass_to_glass.Take();
+                println("Glass to glass frames={} p50={}us p90={}us p99={}us max={}us", glass.size(),
+                        ToMicros(Percentile(glass, 0.5)), ToMicros(Percentile(glass, 0.9)),
+                        ToMicros(Percentile(glass, 0.99)), ToMicros(Percentile(glass, 1.0)));
+            }
+        }
+    }
+
+    if (!relay_settings.urls.empty()) {
+        relay = std::make_unique<RtmpRelay>(relay_settings);
+        relay->SetErrorHandler([](Error error) { println("Relay error={}", error.what()); });
+    }
+
+    if (!record_settings.directory.empty()) {
+        recorder = std::make_unique<SegmentRecorder>(record_settings);
+        recorder->SetErrorHandler([](Error error) { println("Recorder error={}", error.what()); });
+        recorder->SetSegmentHandler([](const std::string& path) { println("Recorded segment {}", path); });
+    }
+
     int counter{};
+    SampleRecorder glass_to_glass;
     server = std::make_unique<RtmpServer>(settings);
     server->SetConnectedHandler([](RtmpServer::StreamInfo info) {
         println("Client connected codec={} fmt={} width={} height={} stream_index={}", info.codec, info.stream_fmt,
                 info.resolution.width, info.resolution.height, info.stream_index);
+        if (relay) relay->Open(info);
+        if (recorder) recorder->Open(info);
+    });
+    server->SetDisconnectedHandler([] {
+        println("Client disconnected dropped_packets={}", server->dropped_packets());
+        if (relay) relay->Close();
+        if (recorder) recorder->Close();
     });
-    server->SetDisconnectedHandler([] { println("Client disconnected"); });
     server->SetErrorHandler([](Error error) { println("Server error={}", error.what()); });
-    server->SetImageHandler([&](Image image) {
-        if (display_image) {
-            cv::imshow(window_name, image);
+    server->SetFrameHandler([&](VideoFrame frame) {
+        if (measure_latency) {
+            // Frames of a sender run with --stamp-time carry the time they were captured
+            if (auto captured = ReadFrameTime(frame.image())) {
+                glass_to_glass.Record(std::chrono::system_clock::now() - *captured);
+            }
+        } else if (display_image) {
+            cv::imshow(window_name, frame.image());
             cv::waitKey(1);
         } else {
             println("Decoded image={}", counter++);
         }
     });
+    if (relay || recorder) {
+        server->SetPacketHandler([](const AVPacket* packet) {
+            if (relay) relay->Push(packet);
+            if (recorder) recorder->Push(packet);
+        });
+    } else if (!settings.decode) {
+        server->SetPacketHandler([&](const AVPacket* packet) {
+            println("Packet={} size={} key={} pts={}", counter++, packet->size, (packet->flags & AV_PKT_FLAG_KEY) != 0,
+                    packet->pts);
+        });
+    }
     server->Start();
 
+    println("Decoder threads={} type={} low_delay={}", settings.decoder_threads,
+            enchantum::to_string(settings.decoder_thread_type), settings.low_delay);
+
+    uint64_t last_decoded{};
     while (1) {
-        usleep(10000);
+        sleep(1);
+        const auto stats = server->stats();
+        if (stats.decoded_frames != last_decoded) {
+            println("Decode fps={} queue={}/{} dropped={} decimated={} decode_p99={}us convert_p99={}us "
+                    "handler_p99={}us latency_p50={}us latency_p99={}us first_image={}us",
+                    stats.decoded_frames - last_decoded, stats.queue_depth, stats.queue_high_water,
+                    stats.dropped_packets, stats.decimated_frames, ToMicros(stats.decode_time.Percentile(0.99)),
+                    ToMicros(stats.convert_time.Percentile(0.99)), ToMicros(stats.handler_time.Percentile(0.99)),
+                    ToMicros(stats.latency.Percentile(0.5)), ToMicros(stats.latency.Percentile(0.99)),
+                    ToMicros(std::chrono::nanoseconds(stats.first_image.max_ns)));
+            last_decoded = stats.decoded_frames;
+        }
+        if (measure_latency) {
+            // Exact over the last second, bucket bounds would be too coarse to compare sender and server settings
+            const auto glass = glass_to_glass.Take();
+            println("Glass to glass frames={} p50={}us p90={}us p99={}us max={}us", glass.size(),
+                    ToMicros(Percentile(glass, 0.5)), ToMicros(Percentile(glass, 0.9)),
+                    ToMicros(Percentile(glass, 0.99)), ToMicros(Percentile(glass, 1.0)));
+        }
     }
 
     return 0;
@@ -0,0 +1,216 @@
+#include "video_frame.hpp"
+
+#include <utility>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/common.h>
+}
+
+namespace oryx {
+
+namespace detail {
+
+struct VideoFrameSlot {
+    av::UniqueFramePtr frame;
+    std::atomic<int> refs;
+    bool wrapped;
+    std::shared_ptr<VideoFramePool> pool;
+};
+
+}  // namespace detail
+
+VideoFrame::VideoFrame() noexcept
+    : slot_() {}
+
+VideoFrame::VideoFrame(detail::VideoFrameSlot* slot) noexcept
+    : slot_(slot) {}
+
+VideoFrame::VideoFrame(const VideoFrame& other) noexcept
+    : slot_(other.slot_) {
+    if (slot_) {
+        slot_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+VideoFrame::VideoFrame(VideoFrame&& other) noexcept
+    : slot_(std::exchange(other.slot_, nullptr)) {}
+
+VideoFrame::~VideoFrame() { Release(); }
+
+auto VideoFrame::operator=(const VideoFrame& other) noexcept -> VideoFrame& {
+    if (this != &other) {
+        Release();
+        slot_ = other.slot_;
+        if (slot_) {
+            slot_->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return *this;
+}
+
+auto VideoFrame::operator=(VideoFrame&& other) noexcept -> VideoFrame& {
+    if (this != &other) {
+        Release();
+        slot_ = std::exchange(other.slot_, nullptr);
+    }
+    return *this;
+}
+
+void VideoFrame::Release() {
+    if (!slot_) {
+        return;
+    }
+
+    if (slot_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        // Keep the pool alive until the slot is back in it
+        auto pool = std::move(slot_->pool);
+        pool->Recycle(slot_);
+    }
+    slot_ = nullptr;
+}
+
+auto VideoFrame::size() const -> ImageSize { return ImageSize(slot_->frame->width, slot_->frame->height); }
+auto VideoFrame::pix_fmt() const -> int { return slot_->frame->format; }
+
+auto VideoFrame::format() const -> PixelFormat {
+    switch (slot_->frame->format) {
+        case AV_PIX_FMT_BGR24:
+            return PixelFormat::kBgr24;
+        case AV_PIX_FMT_GRAY8:
+            return PixelFormat::kGray8;
+        case AV_PIX_FMT_YUV420P:
+            return PixelFormat::kYuv420p;
+        case AV_PIX_FMT_NV12:
+            return PixelFormat::kNv12;
+        default:
+            return PixelFormat::kNative;
+    }
+}
+auto VideoFrame::pts() const -> int64_t { return slot_->frame->pts; }
+auto VideoFrame::data(int plane) const -> uint8_t* { return slot_->frame->data[plane]; }
+auto VideoFrame::linesize(int plane) const -> int { return slot_->frame->linesize[plane]; }
+auto VideoFrame::av_frame() const -> AVFrame* { return slot_->frame.get(); }
+
+auto VideoFrame::plane(int index) const -> Image {
+    auto frame = slot_->frame.get();
+    auto desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    if (!desc || !frame->data[index]) {
+        return Image();
+    }
+
+    // The first component stored in this plane tells us its layout, e.g. U and V interleaved for nv12
+    int comp = 0;
+    while (comp < desc->nb_components && desc->comp[comp].plane != index) comp++;
+    if (comp == desc->nb_components) {
+        return Image();
+    }
+
+    const bool chroma = comp == 1 || comp == 2;
+    const int width = chroma ? AV_CEIL_RSHIFT(frame->width, desc->log2_chroma_w) : frame->width;
+    const int height = chroma ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+    const int bytes = desc->comp[comp].depth > 8 ? 2 : 1;
+    const int channels = desc->comp[comp].step / bytes;
+    const int type = bytes == 2 ? CV_16UC(channels) : CV_8UC(channels);
+    return Image(height, width, type, frame->data[index], frame->linesize[index]);
+}
+
+auto VideoFramePool::Create() -> std::shared_ptr<VideoFramePool> {
+    return std::shared_ptr<VideoFramePool>(new VideoFramePool());
+}
+
+VideoFramePool::VideoFramePool()
+    : mutex_(),
+      free_(),
+      free_wrapped_(),
+      allocations_() {}
+
+VideoFramePool::~VideoFramePool() = default;
+
+auto VideoFramePool::Acquire(ImageSize size, int pix_fmt) -> std::expected<VideoFrame, av::Error> {
+    std::unique_ptr<detail::VideoFrameSlot> slot;
+    {
+        std::lock_guard lock(mutex_);
+        while (!free_.empty() && !slot) {
+            slot = std::move(free_.back());
+            free_.pop_back();
+
+            // Stale slot from before a resolution or format change
+            auto frame = slot->frame.get();
+            if (frame->width != size.width || frame->height != size.height || frame->format != pix_fmt) {
+                slot.reset();
+            }
+        }
+    }
+
+    // A handler may still hold an av_frame_ref of the buffers of a recycled slot, leave those to it
+    if (slot && !av_frame_is_writable(slot->frame.get())) {
+        av_frame_unref(slot->frame.get());
+    }
+
+    if (!slot) {
+        slot = std::make_unique<detail::VideoFrameSlot>();
+        slot->frame = av::MakeUniqueFrame();
+    }
+
+    if (!slot->frame->buf[0]) {
+        slot->frame->width = size.width;
+        slot->frame->height = size.height;
+        slot->frame->format = pix_fmt;
+        int ret = av_frame_get_buffer(slot->frame.get(), 0);
+        if (ret < 0) {
+            return av::UnexpectedError(ret);
+        }
+        allocations_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    slot->refs.store(1, std::memory_order_relaxed);
+    slot->wrapped = false;
+    slot->pool = shared_from_this();
+    return VideoFrame(slot.release());
+}
+
+auto VideoFramePool::Wrap(const AVFrame* src) -> std::expected<VideoFrame, av::Error> {
+    std::unique_ptr<detail::VideoFrameSlot> slot;
+    {
+        std::lock_guard lock(mutex_);
+        if (!free_wrapped_.empty()) {
+            slot = std::move(free_wrapped_.back());
+            free_wrapped_.pop_back();
+        }
+    }
+
+    if (!slot) {
+        slot = std::make_unique<detail::VideoFrameSlot>();
+        slot->frame = av::MakeUniqueFrame();
+        allocations_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int ret = av_frame_ref(slot->frame.get(), src);
+    if (ret < 0) {
+        return av::UnexpectedError(ret);
+    }
+
+    slot->refs.store(1, std::memory_order_relaxed);
+    slot->wrapped = true;
+    slot->pool = shared_from_this();
+    return VideoFrame(slot.release());
+}
+
+void VideoFramePool::Recycle(detail::VideoFrameSlot* slot) {
+    if (slot->wrapped) {
+        // Hand the buffers back to whoever owns them right away
+        av_frame_unref(slot->frame.get());
+    }
+
+    std::lock_guard lock(mutex_);
+    if (slot->wrapped) {
+        free_wrapped_.emplace_back(slot);
+    } else {
+        free_.emplace_back(slot);
+    }
+}
+
+}  // namespace oryx
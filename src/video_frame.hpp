@@ -0,0 +1,110 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <expected>
+
+#include "image.hpp"
+#include "av_helpers.hpp"
+#include "av_error.hpp"
+
+namespace oryx {
+
+class VideoFramePool;
+
+namespace detail {
+
+struct VideoFrameSlot;
+
+}  // namespace detail
+
+/**
+ * @brief Ref counted handle to a decoded frame. Copies share the same buffers which return to their pool once the
+ * last handle is released. Copying never allocates.
+ */
+class VideoFrame {
+public:
+    VideoFrame() noexcept;
+    VideoFrame(const VideoFrame& other) noexcept;
+    VideoFrame(VideoFrame&& other) noexcept;
+    ~VideoFrame();
+
+    auto operator=(const VideoFrame& other) noexcept -> VideoFrame&;
+    auto operator=(VideoFrame&& other) noexcept -> VideoFrame&;
+
+    explicit operator bool() const { return slot_ != nullptr; }
+
+    auto size() const -> ImageSize;
+    auto format() const -> PixelFormat;
+    auto pix_fmt() const -> int;
+    auto pts() const -> int64_t;
+    auto data(int plane) const -> uint8_t*;
+    auto linesize(int plane) const -> int;
+
+    /**
+     * @brief The underlying frame. Keeping an av_frame_ref of it beyond this handle is safe, the pool then hands out
+     * fresh buffers instead of reusing these
+     */
+    auto av_frame() const -> AVFrame*;
+
+    /**
+     * @brief Non owning view on plane index sized to that plane. Only valid as long as this frame is alive
+     */
+    auto plane(int index) const -> Image;
+
+    /**
+     * @brief Non owning view on the first plane. The whole image for packed formats, luma for yuv formats
+     */
+    auto image() const -> Image { return plane(0); }
+
+private:
+    friend class VideoFramePool;
+
+    explicit VideoFrame(detail::VideoFrameSlot* slot) noexcept;
+    void Release();
+
+    detail::VideoFrameSlot* slot_;
+};
+
+/**
+ * @brief Recycles frames. Released frames are handed out again instead of allocating, so once warmed up decoding at
+ * a steady resolution does no heap allocations. The first frames, every resolution or format change and buffers still
+ * referenced elsewhere allocate. Frames keep their pool alive.
+ */
+class VideoFramePool : public std::enable_shared_from_this<VideoFramePool> {
+public:
+    static auto Create() -> std::shared_ptr<VideoFramePool>;
+
+    ~VideoFramePool();
+
+    /**
+     * @brief Frame with writable buffers for size and pix_fmt
+     */
+    auto Acquire(ImageSize size, int pix_fmt) -> std::expected<VideoFrame, av::Error>;
+
+    /**
+     * @brief Frame referencing the buffers of src without copying
+     */
+    auto Wrap(const AVFrame* src) -> std::expected<VideoFrame, av::Error>;
+
+    /**
+     * @brief Number of frames this pool had to allocate
+     */
+    auto allocations() const -> uint64_t { return allocations_.load(std::memory_order_relaxed); }
+
+private:
+    friend class VideoFrame;
+
+    VideoFramePool();
+
+    void Recycle(detail::VideoFrameSlot* slot);
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<detail::VideoFrameSlot>> free_;
+    std::vector<std::unique_ptr<detail::VideoFrameSlot>> free_wrapped_;
+    std::atomic<uint64_t> allocations_;
+};
+
+}  // namespace oryx
@@ -0,0 +1,65 @@
+#include "worker_group.hpp"
+
+#include <algorithm>
+
+namespace oryx {
+
+WorkerGroup::WorkerGroup(size_t thread_count)
+    : start_(static_cast<std::ptrdiff_t>(std::max<size_t>(thread_count, 1))),
+      done_(static_cast<std::ptrdiff_t>(std::max<size_t>(thread_count, 1))),
+      fn_(),
+      count_(),
+      next_(),
+      stop_(),
+      workers_() {
+    for (size_t i = 1; i < thread_count; i++) {
+        workers_.emplace_back([this] { Worker(); });
+    }
+}
+
+WorkerGroup::~WorkerGroup() {
+    if (workers_.empty()) {
+        return;
+    }
+
+    // Release the parked workers without a job, they leave on seeing stop_
+    stop_ = true;
+    start_.arrive_and_wait();
+    workers_.clear();
+}
+
+void WorkerGroup::Run(size_t count, const TaskFn& fn) {
+    if (workers_.empty() || count <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    fn_ = &fn;
+    count_ = count;
+    next_.store(0, std::memory_order_relaxed);
+
+    start_.arrive_and_wait();
+    RunTasks();
+    done_.arrive_and_wait();
+}
+
+void WorkerGroup::RunTasks() {
+    for (auto i = next_.fetch_add(1); i < count_; i = next_.fetch_add(1)) {
+        (*fn_)(i);
+    }
+}
+
+void WorkerGroup::Worker() {
+    while (true) {
+        start_.arrive_and_wait();
+        if (stop_) {
+            return;
+        }
+        RunTasks();
+        done_.arrive_and_wait();
+    }
+}
+
+}  // namespace oryx
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <barrier>
+#include <functional>
+
+namespace oryx {
+
+/**
+ * @brief Small fork join group for splitting one job into parallel tasks. Idle workers park on a barrier.
+ */
+class WorkerGroup {
+public:
+    using TaskFn = std::function<void(size_t)>;
+
+    /**
+     * @param thread_count Threads taking part in Run including the caller
+     */
+    explicit WorkerGroup(size_t thread_count);
+    ~WorkerGroup();
+
+    /**
+     * @brief Calls fn for every index in [0, count) spread over the group. The calling thread takes part. Blocks
+     * until every call returned. Must not be called concurrently
+     */
+    void Run(size_t count, const TaskFn& fn);
+
+    auto size() const -> size_t { return workers_.size() + 1; }
+
+private:
+    void RunTasks();
+    void Worker();
+
+    std::barrier<> start_;
+    std::barrier<> done_;
+    const TaskFn* fn_;
+    size_t count_;
+    std::atomic<size_t> next_;
+    bool stop_;
+    std::vector<std::jthread> workers_;
+};
+
+}  // namespace oryx
@@ -13,6 +13,7 @@ function(BuildTarget TARGET_NAME)
         "-DCMAKE_BUILD_TYPE=${CMAKE_BUILD_TYPE}"
         "-DCMAKE_INSTALL_PREFIX:PATH=${TARGET_INSTALL_DIR}"
         "-DCMAKE_PREFIX_PATH:PATH=${CMAKE_PREFIX_PATH}"
+        "-DENABLE_ASM=${ENABLE_ASM}"
     )
 
     if(DEFINED CMAKE_TOOLCHAIN_FILE AND NOT CMAKE_TOOLCHAIN_FILE STREQUAL "")
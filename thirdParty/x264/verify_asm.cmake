@@ -0,0 +1,6 @@
+# Fails when x264's configure disabled its assembly, e.g. because no suitable nasm was found
+file(STRINGS "${CONFIG_H}" ASM_DEFINES REGEX "^#define HAVE_(MMX|NEON) 1")
+if(NOT ASM_DEFINES)
+    message(FATAL_ERROR "x264 was configured without assembly, see ${CONFIG_H}")
+endif()
+message(STATUS "x264 assembly enabled: ${ASM_DEFINES}")